@@ -0,0 +1,119 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "ioengine.h"
+
+/*
+ * BlockDevice
+ * Access to the disk image by byte offset, behind a table of backend
+ * operations so the I/O strategy is picked at mount time:
+ *   pread  - positional pread/pwrite on a file descriptor, no user-space buffering
+ *   mmap   - the whole image mapped MAP_SHARED, reads and writes are memcpy
+ *   memory - the whole image read into RAM at open and written back on sync/close,
+ *            so nothing touches the disk in between
+ *   direct - pread/pwrite on an O_DIRECT descriptor, bypassing the page cache.
+ *            Requests whose offset, length and buffer are all aligned go straight
+ *            to the disk, anything else through an aligned bounce block with
+ *            read-modify-write of the partial blocks at either end
+ * Callers use the blockdev_* wrappers below, never the ops directly.
+ *
+ * Batches of requests go through blockdev_submit(). The pread and direct
+ * backends can run them on an io_uring (blockdev_enable_async), everything
+ * else does them one after the other.
+ */
+
+typedef enum {
+    BLOCKDEV_PREAD,
+    BLOCKDEV_MMAP,
+    BLOCKDEV_MEMORY,
+    BLOCKDEV_DIRECT
+} BlockDevKind;
+
+typedef struct BlockDevice BlockDevice;
+
+typedef struct {
+    const char *name;
+    bool (*read)(BlockDevice *dev, uint64_t offset, void *buf, size_t len);
+    bool (*write)(BlockDevice *dev, uint64_t offset, const void *buf, size_t len);
+    bool (*submit)(BlockDevice *dev, IoRequest *reqs, uint32_t count); // NULL: one read/write per request
+    const unsigned char* (*map)(BlockDevice *dev, uint64_t offset, size_t len); // NULL when the backend has no mapping
+    bool (*readahead)(BlockDevice *dev, uint64_t offset, size_t len); // NULL when there is no cache to warm
+    bool (*copy_out)(BlockDevice *dev, uint64_t offset, size_t len, int out_fd);
+    bool (*flush)(BlockDevice *dev);
+    bool (*sync)(BlockDevice *dev);
+    void (*close)(BlockDevice *dev); // release backend resources, not the BlockDevice itself
+} BlockDeviceOps;
+
+struct BlockDevice {
+    const BlockDeviceOps *ops;
+    int fd; // image file
+    uint64_t size; // image size in bytes
+    unsigned char *data; // mmap/memory backends: the whole image
+    uint64_t dirty_lo; // memory backend: bytes [dirty_lo, dirty_hi) written since the last sync
+    uint64_t dirty_hi;
+    IoEngine engine; // pread/direct backends with async enabled
+    bool async; // engine is set up
+    int direct_fd; // direct backend: O_DIRECT descriptor of the same file, -1 otherwise
+    uint32_t align; // direct backend: required alignment of offsets, lengths and buffers, 1 otherwise
+    uint64_t direct_end; // direct backend: end of the last whole aligned block, the tail past it goes through fd
+    unsigned char *bounce; // direct backend: DIRECT_BOUNCE_BYTES aligned buffer for unaligned requests
+};
+
+#define DIRECT_BOUNCE_BYTES (64 * 1024)
+
+/* most buffers one vectored call of a synchronous batch covers */
+#define BLOCKDEV_MAX_IOV 256
+
+/* Open the image read/write with the given backend. NULL on failure. When the
+ * file system refuses O_DIRECT, BLOCKDEV_DIRECT opens as the pread backend */
+BlockDevice* blockdev_open(const char *path, BlockDevKind kind);
+
+/* Parse a backend name ("pread", "mmap", "memory", "direct"). False if unknown */
+bool blockdev_kind_from_name(const char *name, BlockDevKind *kind);
+
+/* Backend name, for messages */
+const char* blockdev_name(const BlockDevice *dev);
+
+/* Write back whatever the backend holds and release the device */
+void blockdev_close(BlockDevice *dev);
+
+/* Alignment buffers handed to the device should have to avoid bounce copies (1: any) */
+size_t blockdev_alignment(const BlockDevice *dev);
+
+/* Read/write len bytes at offset. False on I/O error or past the end of the image */
+bool blockdev_read(BlockDevice *dev, uint64_t offset, void *buf, size_t len);
+bool blockdev_write(BlockDevice *dev, uint64_t offset, const void *buf, size_t len);
+
+/* Read-only pointer to len bytes of the image at offset when the backend keeps
+ * the image in memory (mmap, memory), NULL otherwise. Use blockdev_write to change it */
+const unsigned char* blockdev_map(BlockDevice *dev, uint64_t offset, size_t len);
+
+/* Ask the OS to start reading len bytes at offset into its cache and return
+ * at once (fadvise for pread, madvise for mmap). False when the backend has no
+ * OS cache in between (memory, direct) */
+bool blockdev_readahead(BlockDevice *dev, uint64_t offset, size_t len);
+
+/* Write len bytes of the image at offset to out_fd (at its current position).
+ * The backends with a file behind them let the kernel copy the data
+ * (copy_file_range, or sendfile for pipes and sockets) so it never enters
+ * user space; the memory backend writes from its copy of the image */
+bool blockdev_copy_out(BlockDevice *dev, uint64_t offset, size_t len, int out_fd);
+
+/* Run a batch of non-overlapping requests to completion. False if any failed.
+ * Synchronously, requests that continue each other on disk in the same
+ * direction go out as one preadv/pwritev, so batches should be in offset order */
+bool blockdev_submit(BlockDevice *dev, IoRequest *reqs, uint32_t count);
+
+/* Run batches on an io_uring of the given depth. False (and the device stays
+ * synchronous) when the backend has no use for it or io_uring is unavailable */
+bool blockdev_enable_async(BlockDevice *dev, unsigned depth);
+
+/* Batches are run asynchronously */
+bool blockdev_is_async(const BlockDevice *dev);
+
+/* Hand written data to the OS (no-op for pread, asynchronous msync for mmap) */
+bool blockdev_flush(BlockDevice *dev);
+
+/* Make everything written so far durable on disk */
+bool blockdev_sync(BlockDevice *dev);
@@ -0,0 +1,103 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "blockdev.h"
+#include "journal.h"
+
+/*
+ * BufCache
+ * Write-back cache of data-region clusters (directory and file contents
+ * alike), sized by a byte budget. Entries are found through a hash on the
+ * cluster number and kept on an LRU list. A pinned entry is never evicted,
+ * and a dirty one is written to the device when it is evicted (along with
+ * the dirty clusters next to it on disk) or on buf_cache_flush().
+ *
+ * When the device already holds the image in memory (mmap and memory
+ * backends) the cache keeps no copies: pins return pointers into the device
+ * and writes go straight to it.
+ *
+ * Clusters written with buf_cache_write_meta() hold directory entries. With
+ * a journal they are never written in place or evicted while dirty: they go
+ * into the operation's transaction (buf_cache_log), are then LOGGED, and
+ * reach their home location on eviction or buf_cache_flush() once the log is
+ * durable. Such a cache always keeps copies, even of a mapped image.
+ */
+
+/* budget used when the mount options give 0 */
+#define BUF_CACHE_DEFAULT_BYTES (1024 * 1024)
+
+/* never fewer entries than this, whatever the budget */
+#define BUF_CACHE_MIN_ENTRIES 8
+
+/* most clusters an eviction writes back in one go */
+#define BUF_WRITE_RUN_MAX 64
+
+typedef struct {
+    uint32_t cluster; // cached cluster, 0 = entry unused
+    uint32_t pins; // outstanding buf_cache_pin calls
+    bool dirty; // differs from the image (and, for meta entries, from the journal)
+    bool meta; // holds directory entries, journaled instead of written in place
+    bool logged; // contents are in the journal but not yet at their home location
+    uint32_t hash_next; // next entry in the same hash bucket
+    uint32_t lru_prev; // neighbour toward the most recently used end
+    uint32_t lru_next; // neighbour toward the least recently used end
+} BufEntry;
+
+typedef struct {
+    BlockDevice *dev;
+    uint64_t data_offset; // byte offset of cluster 2
+    uint32_t cluster_size; // bytes per cluster
+    bool direct; // device keeps the image in memory, nothing is copied
+    unsigned char *data; // num_entries * cluster_size bytes
+    BufEntry *entries;
+    uint32_t num_entries;
+    uint32_t *buckets; // first entry per bucket
+    uint32_t bucket_mask; // buckets - 1, buckets is a power of two
+    uint32_t lru_head; // most recently used entry
+    uint32_t lru_tail; // least recently used entry
+    uint32_t dirty_count;
+    uint32_t logged_count;
+    Journal *journal; // journal meta entries go through, NULL without one
+} BufCache;
+
+/* Set up a cache of about budget_bytes (BUF_CACHE_DEFAULT_BYTES if 0). 'journal'
+ * is NULL or inactive when directory writes need not wait for one */
+bool buf_cache_init(BufCache *cache, BlockDevice *dev, uint64_t data_offset, uint32_t cluster_size, size_t budget_bytes,
+                    Journal *journal);
+
+/* Release the cache. Dirty entries are dropped, flush first */
+void buf_cache_free(BufCache *cache);
+
+/* Pin 'cluster' and return its contents for reading, loading it on a miss.
+ * Stays valid until the matching buf_cache_unpin. NULL on I/O error or when
+ * every entry is pinned */
+const unsigned char* buf_cache_pin(BufCache *cache, uint32_t cluster);
+void buf_cache_unpin(BufCache *cache, uint32_t cluster);
+
+/* Copy len bytes at 'offset' within 'cluster' out of / into the cache. Writes
+ * mark the entry dirty, a write covering the whole cluster skips the load */
+bool buf_cache_read(BufCache *cache, uint32_t cluster, uint32_t offset, void *dst, uint32_t len);
+bool buf_cache_write(BufCache *cache, uint32_t cluster, uint32_t offset, const void *src, uint32_t len);
+
+/* buf_cache_write() for directory clusters, see above */
+bool buf_cache_write_meta(BufCache *cache, uint32_t cluster, uint32_t offset, const void *src, uint32_t len);
+
+/* Load whichever of the 'count' clusters are not cached yet with one batch of
+ * reads (asynchronous when the device is). At most half the cache is filled
+ * per call. False on I/O error */
+bool buf_cache_prefetch(BufCache *cache, const uint32_t *clusters, uint32_t count);
+
+/* Forget clusters [first, first + count) without writing them back (they were freed) */
+void buf_cache_invalidate(BufCache *cache, uint32_t first, uint32_t count);
+
+/* Write every dirty or logged entry back as one batch, in cluster order */
+bool buf_cache_flush(BufCache *cache);
+
+/* Same, for the entries holding file data only */
+bool buf_cache_flush_data(BufCache *cache);
+
+/* Add every dirty meta entry to a journal transaction. Once the transaction
+ * is in the log, buf_cache_logged() marks them LOGGED instead of dirty */
+bool buf_cache_log(BufCache *cache, JournalTxn *txn);
+void buf_cache_logged(BufCache *cache);
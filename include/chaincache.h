@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "extent.h"
+
+/*
+ * ChainCache
+ * Bounded LRU of resolved cluster chains, keyed by a chain's start cluster.
+ * Each slot holds the chain as an ExtentMap plus the lowest and highest
+ * cluster it covers, so dropping every chain that touches a changed FAT entry
+ * only looks inside slots whose bounds contain it.
+ */
+
+/* chains kept by a cache set up with 0 slots */
+#define CHAIN_CACHE_DEFAULT_SLOTS 64
+
+typedef struct {
+    uint32_t start; // first cluster of the chain, 0 = slot empty
+    uint32_t lo; // lowest cluster in the chain
+    uint32_t hi; // highest cluster in the chain
+    uint64_t last_used; // LRU stamp
+    ExtentMap map;
+} ChainCacheSlot;
+
+typedef struct {
+    ChainCacheSlot *slots; // dynamically allocated, MUST BE FREED with chain_cache_free
+    uint32_t num_slots;
+    uint64_t clock; // bumped on every hit and insert
+} ChainCache;
+
+bool chain_cache_init(ChainCache *cache, uint32_t num_slots);
+void chain_cache_free(ChainCache *cache);
+
+/* Cached chain starting at 'start', NULL on a miss. The pointer is only good
+ * until the next put or invalidate */
+const ExtentMap* chain_cache_get(ChainCache *cache, uint32_t start);
+
+/* Move *map into the cache as the chain for 'start', evicting the least
+ * recently used slot if needed. *map is left empty (it takes over the evicted
+ * slot's storage) and stays owned by the caller */
+const ExtentMap* chain_cache_put(ChainCache *cache, uint32_t start, ExtentMap *map);
+
+/* Drop the chain keyed by 'start', if cached */
+void chain_cache_invalidate(ChainCache *cache, uint32_t start);
+
+/* Drop every cached chain that contains a cluster in [first, first + count) */
+void chain_cache_invalidate_range(ChainCache *cache, uint32_t first, uint32_t count);
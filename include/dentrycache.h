@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * DentryCache
+ * Results of recent name lookups, keyed by (directory, short name): either
+ * what the entry holds and where it lives, or that the directory has no such
+ * name (a negative entry). Set associative, DENTRY_CACHE_WAYS entries per
+ * set, least recently used way replaced first. Everything that adds, removes
+ * or rewrites an entry forgets or replaces the cached result for it.
+ */
+
+/* sets in the cache, DENTRY_CACHE_WAYS entries each */
+#define DENTRY_CACHE_SETS 1024
+#define DENTRY_CACHE_WAYS 4
+
+typedef struct {
+    uint32_t parent; // first cluster of the directory searched, 0 = unused
+    char name[11]; // short name looked up
+    bool negative; // parent has no entry called name, the fields below are unused
+    uint8_t attr; // entry attributes
+    uint32_t first_cluster; // first cluster of the entry's file or directory
+    uint32_t size; // file size
+    uint32_t entry_cluster; // directory cluster holding the entry
+    uint32_t entry_offset; // byte offset of the entry within entry_cluster
+    uint64_t last_used; // LRU stamp within the set
+} Dentry;
+
+typedef struct {
+    Dentry *entries; // DENTRY_CACHE_SETS * DENTRY_CACHE_WAYS, MUST BE FREED with dentry_cache_free
+    uint32_t count; // entries in use
+    uint64_t clock; // bumped on every hit and insert
+} DentryCache;
+
+bool dentry_cache_init(DentryCache *cache);
+void dentry_cache_free(DentryCache *cache);
+
+/* Cached result for name in parent, NULL on a miss. The pointer is only good
+ * until the next put */
+const Dentry* dentry_cache_get(DentryCache *cache, uint32_t parent, const char name[11]);
+
+/* Remember d (its parent and name are the key), replacing an older result
+ * for the same key or the set's least recently used entry */
+void dentry_cache_put(DentryCache *cache, const Dentry *d);
+
+/* Forget what is cached for name in parent */
+void dentry_cache_forget(DentryCache *cache, uint32_t parent, const char name[11]);
+
+/* Forget everything cached under directory parent */
+void dentry_cache_forget_dir(DentryCache *cache, uint32_t parent);
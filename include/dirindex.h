@@ -0,0 +1,90 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * DirIndex
+ * Bounded LRU of per-directory hash tables, keyed by a directory's first
+ * cluster. A table maps each 11-byte short name in the directory to where
+ * its entry lives (directory cluster and byte offset in that cluster) and
+ * its attributes. A table is built from one full scan of the directory and
+ * is complete from then on, so a name that is not in it does not exist.
+ * Whoever adds, removes or renames an entry keeps the table in step (or
+ * drops it).
+ *
+ * A table also keeps where new entries can go: the slots of deleted entries,
+ * the end marker (the first 0x00 slot) and the directory's last cluster, so
+ * a new entry is placed without scanning the directory for a free slot.
+ */
+
+/* directories kept by an index set up with 0 slots */
+#define DIR_INDEX_DEFAULT_SLOTS 16
+
+typedef struct {
+    uint32_t slot; // entry number within the directory, counted along the chain
+    uint32_t cluster; // directory cluster holding the slot
+    uint32_t offset; // byte offset of the slot within that cluster
+} DirSlot;
+
+typedef struct {
+    char name[11]; // short name as stored in the entry
+    uint8_t state; // DIR_INDEX_EMPTY, DIR_INDEX_USED or DIR_INDEX_DELETED
+    uint8_t attr; // entry attributes (byte 11)
+    DirSlot at; // where the entry lives
+} DirIndexEntry;
+
+#define DIR_INDEX_EMPTY   0
+#define DIR_INDEX_USED    1
+#define DIR_INDEX_DELETED 2 // tombstone, keeps probe sequences intact
+
+typedef struct {
+    uint32_t dir; // first cluster of the directory, 0 = slot empty
+    uint64_t last_used; // LRU stamp
+    DirIndexEntry *entries; // open addressing table, capacity is a power of two
+    uint32_t capacity;
+    uint32_t count; // names in the table
+    uint32_t tombstones;
+    DirSlot *free_slots; // deleted entries before the end marker, min heap on slot number
+    uint32_t free_count;
+    uint32_t free_capacity;
+    DirSlot end; // the end marker, valid if has_end
+    bool has_end; // false once every slot up to the end of the chain is taken
+    uint32_t tail; // last cluster of the directory's chain
+    uint32_t num_clusters; // clusters in the chain
+} DirIndexSlot;
+
+typedef struct {
+    DirIndexSlot *slots; // dynamically allocated, MUST BE FREED with dir_index_free
+    uint32_t num_slots;
+    uint64_t clock; // bumped on every hit and insert
+} DirIndex;
+
+bool dir_index_init(DirIndex *index, uint32_t num_slots);
+void dir_index_free(DirIndex *index);
+
+/* Table for directory 'dir', NULL if it has not been built. The pointer is
+ * only good until the next dir_index_create or dir_index_drop */
+DirIndexSlot* dir_index_get(DirIndex *index, uint32_t dir);
+
+/* Empty table for 'dir' to be filled by the caller, evicting the least
+ * recently used directory if needed. A table that cannot be filled
+ * completely must be dropped again */
+DirIndexSlot* dir_index_create(DirIndex *index, uint32_t dir);
+
+/* Forget directory 'dir', if indexed */
+void dir_index_drop(DirIndex *index, uint32_t dir);
+
+/* Add or move 'name'. Returns false on OOM, the table is then incomplete */
+bool dir_index_insert(DirIndexSlot *slot, const char name[11], const DirSlot *at, uint8_t attr);
+
+/* Entry for 'name', NULL if the directory has no such name */
+const DirIndexEntry* dir_index_find(const DirIndexSlot *slot, const char name[11]);
+
+void dir_index_remove(DirIndexSlot *slot, const char name[11]);
+
+/* Slot 'at' is free again. Returns false on OOM, the table must then be
+ * dropped */
+bool dir_index_release_slot(DirIndexSlot *slot, const DirSlot *at);
+
+/* Takes the first free slot before the end marker, false if there is none */
+bool dir_index_take_slot(DirIndexSlot *slot, DirSlot *out);
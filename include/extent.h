@@ -0,0 +1,49 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * ClusterExtent
+ * A run of 'length' consecutive clusters starting at cluster 'start'.
+ * 'file_index' is the position of the run's first cluster within the file
+ * (0 for the first cluster of the chain).
+ */
+typedef struct {
+    uint32_t start;
+    uint32_t length;
+    uint32_t file_index;
+} ClusterExtent;
+
+/*
+ * ExtentMap
+ * A cluster chain stored as sorted runs, so the cluster holding the Nth
+ * cluster-sized piece of a file is found by binary search instead of
+ * following N FAT links.
+ */
+typedef struct {
+    ClusterExtent *runs; // dynamically allocated, MUST BE FREED with extent_map_free
+    uint32_t count; // runs in use
+    uint32_t capacity; // runs allocated
+    uint32_t total_clusters; // clusters covered by all runs
+} ExtentMap;
+
+void extent_map_init(ExtentMap *map);
+void extent_map_free(ExtentMap *map);
+
+/* Forget all runs but keep the allocation */
+void extent_map_clear(ExtentMap *map);
+
+/* Drop everything past the first 'clusters' clusters */
+void extent_map_truncate(ExtentMap *map, uint32_t clusters);
+
+/* Add the next cluster of the chain, extending the last run when contiguous */
+bool extent_map_append(ExtentMap *map, uint32_t cluster);
+
+/* Cluster number holding the file's index-th cluster, 0 if past the end */
+uint32_t extent_map_lookup(const ExtentMap *map, uint32_t index);
+
+/* Last cluster of the chain, 0 if empty */
+uint32_t extent_map_last(const ExtentMap *map);
+
+/* First cluster of the chain, 0 if empty */
+uint32_t extent_map_first(const ExtentMap *map);
@@ -3,7 +3,17 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
 #include "utils.h"
+#include "blockdev.h"
+#include "fatcache.h"
+#include "freemap.h"
+#include "fatstats.h"
+#include "chaincache.h"
+#include "dirindex.h"
+#include "dentrycache.h"
+#include "bufcache.h"
+#include "journal.h"
 
 /*
  * FAT32 Boot Sector 
@@ -14,15 +24,57 @@ typedef struct {
     uint16_t reserved_sector_count;
     uint8_t  num_fats;
     uint32_t fat_size_sectors;
+    uint16_t ext_flags; // bit 7 set: only FAT (ext_flags & 0xF) is active, no mirroring
     uint32_t total_sectors;
     uint32_t root_cluster;
+    uint16_t fsinfo_sector;
 } Fat32BootSector;
 
+/*
+ * Durability
+ * When changes have to be on stable storage, see fs_commit().
+ *   NONE      operations stay in the caches; written back when evicted, on
+ *             sync and at unmount
+ *   CLOSE     like NONE, but closing a file also writes back and fsyncs
+ *   PERIODIC  written back after every operation, fsynced at most every
+ *             sync_interval seconds
+ *   STRICT    written back and fsynced after every operation
+ * With a journal every operation is still logged as one transaction, the
+ * mode only decides when the log is fsynced beyond its group commits.
+ */
+typedef enum {
+    DURABILITY_NONE,
+    DURABILITY_CLOSE,
+    DURABILITY_PERIODIC,
+    DURABILITY_STRICT
+} Durability;
+
+/* seconds between fsyncs in DURABILITY_PERIODIC unless told otherwise */
+#define DURABILITY_DEFAULT_INTERVAL 5
+
+/*
+ * CwdPath
+ * The directories leading from the root down to the current working
+ * directory, pushed and popped by fs_cd() so getcwd() can print the path
+ * without reading anything.
+ */
+typedef struct {
+    uint32_t cluster; // first cluster of the directory
+    char name[13]; // its name as shown in paths, "NAME.EXT"
+} CwdLevel;
+
+typedef struct {
+    CwdLevel *levels; // the root's child first, dynamically allocated, MUST BE FREED
+    uint32_t depth; // levels in use, 0 at the root
+    uint32_t capacity;
+    bool valid; // false after an allocation failure, getcwd() then walks the tree
+} CwdPath;
+
 /*
  * FileSystem
  */
 typedef struct {
-    FILE *image; // handle to opened FAT32 image file
+    BlockDevice *image; // opened FAT32 image, every read and write goes through it
     char  image_name[256];  // name shown in the shell prompt
     Fat32BootSector bpb; // boot sector info for this FS
 
@@ -32,13 +84,86 @@ typedef struct {
     uint32_t total_clusters; // first sector of data region (cluster #2)
 
     uint32_t cwd_cluster; // cluster of current working directory
+    CwdPath cwd_path; // how cwd_cluster was reached from the root
+
+    FatCache fat_cache; // in-memory FAT sectors, written back by fs_flush()/fs_unmount()
+    FreeMap free_map; // used/free bit per cluster, free count and next-free cursor
+    ChainCache chain_cache; // resolved chains of recently walked directories and files
+    DirIndex dir_index; // short name -> entry tables of recently searched directories
+    DentryCache dentry_cache; // (directory, name) -> entry, or known absent, for recent lookups
+    BufCache buf_cache; // data-region clusters, written back by fs_flush()/fs_unmount()
+    bool fsinfo_valid; // FSInfo sector has good signatures and is rewritten on unmount
+    Journal journal; // metadata log next to the image, inactive unless MountOptions.journal
+    bool checkpoint_due; // checkpoint at the next fs_flush(), set when logged clusters are freed
+    bool frees_uncommitted; // clusters were freed by journal records not fsynced yet, see commit_frees()
+    Durability durability; // when fs_commit() makes changes durable, see fs_set_durability()
+    unsigned sync_interval; // seconds between fsyncs in DURABILITY_PERIODIC
+    time_t last_sync; // when the image (or journal) was last fsynced
+
+    unsigned scan_threads; // threads for the full FAT pass (MountOptions), 0 = no forced pass
+    FatStats fat_stats; // filled by the full FAT pass when scan_threads > 0
+    bool fat_stats_valid;
 
 } FileSystem;
 
+/*
+ * DirEntryRef
+ * A directory entry as resolved by fs_resolve(): what the entry says about
+ * the file and where the entry itself lives, so a command can check, read,
+ * write and update a file without looking its name up again.
+ */
+typedef struct {
+    char name[11]; // short name as stored in the entry
+    uint8_t attr; // entry attributes, 0x10 = directory
+    uint32_t first_cluster; // first cluster of the file, 0 if it has none yet
+    uint32_t size; // file size in bytes
+    uint32_t dir_cluster; // first cluster of the directory holding the entry
+    uint32_t entry_cluster; // directory cluster the entry is in
+    uint32_t entry_offset; // byte offset of the entry within entry_cluster
+} DirEntryRef;
+
+/*
+ * MountOptions
+ * Knobs for fs_mount_with(). mount_options_default() gives what fs_mount() uses.
+ */
+typedef struct {
+    unsigned scan_threads; // >0: always scan the whole FAT at mount on this many threads and collect FatStats
+    BlockDevKind device; // image backend, BLOCKDEV_PREAD by default
+    size_t cache_bytes; // buffer cache budget, 0 = BUF_CACHE_DEFAULT_BYTES
+    bool async_io; // batch reads and writes through io_uring where the backend allows it
+    bool journal; // log metadata to <image>.jnl before it is written in place
+    Durability durability; // DURABILITY_PERIODIC by default
+    unsigned sync_interval; // seconds for DURABILITY_PERIODIC, 0 = DURABILITY_DEFAULT_INTERVAL
+} MountOptions;
+
+void mount_options_default(MountOptions *opts);
+
 /* Mount/unmount functions */
 bool fs_mount(FileSystem *fs, const char *image_path);
+bool fs_mount_with(FileSystem *fs, const char *image_path, const MountOptions *opts);
 void fs_unmount(FileSystem *fs);
 
+/* Write cached FAT sectors and clusters back (or, with a journal, log the
+ * metadata as one transaction) and push buffered image writes to the OS */
+bool fs_flush(FileSystem *fs);
+
+/* End of a mutating operation: flush and sync as the durability mode asks */
+bool fs_commit(FileSystem *fs);
+
+/* A file was closed, DURABILITY_CLOSE syncs here */
+bool fs_file_closed(FileSystem *fs);
+
+/* Flush everything and make the image durable (the shell's sync command) */
+bool fs_sync(FileSystem *fs);
+
+/* Switch modes at runtime, interval 0 keeps the current one. What is pending
+ * is committed under the new mode right away */
+bool fs_set_durability(FileSystem *fs, Durability mode, unsigned interval);
+
+/* "none", "close", "periodic", "strict" */
+bool durability_from_name(const char *name, Durability *mode);
+const char* durability_name(Durability mode);
+
 /* Part 1: print boot sector + computed filesystem information */
 void cmd_info(const FileSystem *fs);
 
@@ -52,11 +177,11 @@ bool fs_creat(FileSystem *fs, const char *name);
 /* List directory contents of the current working directory */
 void fs_ls( FileSystem *fs);
 
-/* Change current working directory to DIRNAME */
+/* Change current working directory to the directory at path */
 bool fs_cd(FileSystem *fs, const char *dirname);
 
-/* Return the full path of the current working directory. The returned
- * string is dynamically allocated and must be freed by the caller. */
+/* Return the full path of the current working directory, from fs->cwd_path.
+ * The returned string is dynamically allocated and must be freed by the caller. */
 CurrentDirectory getcwd(FileSystem *fs);
 
 size_t checkExists(char* filename, FileSystem* fs);
@@ -67,9 +192,15 @@ uint32_t getStartCluster(char* filename, FileSystem* fs);
 
 uint32_t getFileSize(char* filename, FileSystem* fs);
 
-uint32_t readFile(uint32_t startOffset, uint32_t sizeToRead, char* filename, FileSystem* fs);
+/* Look name up in the current working directory once. False if it does not exist */
+bool fs_resolve(FileSystem *fs, const char *name, DirEntryRef *ref);
+
+uint32_t readFile(uint32_t startOffset, uint32_t sizeToRead, const DirEntryRef* ref, FileSystem* fs, OpenFile* file);
+
+uint32_t exportFile(uint32_t startOffset, uint32_t sizeToExport, const DirEntryRef* ref, int outFd, FileSystem* fs, OpenFile* file);
 
-uint32_t writeToFile(const char* filename, const char* bytesToWrite, uint32_t startOffset, FileSystem* fs , OpenFile* file );
+/* Also brings ref's first_cluster and size up to date */
+uint32_t writeToFile(DirEntryRef* ref, const char* bytesToWrite, uint32_t startOffset, FileSystem* fs , OpenFile* file );
 
 bool fs_rm(FileSystem *fs, char *filename, struct OpenFiles *open_files , char* cwd);
 
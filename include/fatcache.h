@@ -0,0 +1,67 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "blockdev.h"
+#include "journal.h"
+
+/*
+ * FatCache
+ * In-memory copy of the FAT. Sectors are loaded from the image on first use,
+ * entries are read and written in memory, and dirty sectors are written back
+ * in runs of consecutive sectors by fat_cache_flush(). Every run goes to each
+ * of the num_copies mirrored FATs, so an entry touched many times between
+ * flushes costs one sector write per copy.
+ *
+ * With a journal, dirty sectors go into the operation's transaction first
+ * (fat_cache_log) and are then only LOGGED: their home location is written
+ * at the next fat_cache_flush(), which the journal calls a checkpoint.
+ */
+
+#define FAT_SECTOR_LOADED 0x01
+#define FAT_SECTOR_DIRTY  0x02
+#define FAT_SECTOR_LOGGED 0x04 // in the journal, not yet written to the FAT itself
+
+/* how many sectors a cache miss pulls in with one read */
+#define FAT_CACHE_READAHEAD 32
+
+typedef struct {
+    unsigned char *data; // num_sectors * sector_size bytes, sector images of the FAT
+    uint8_t *state; // FAT_SECTOR_* flags for every sector
+    uint32_t num_sectors; // sectors in one FAT
+    uint32_t sector_size; // bytes per sector
+    long base_offset; // byte offset of the FAT that is read, and of the first copy written
+    uint32_t num_copies; // FAT copies that receive every flush (BPB num_fats, 1 if not mirrored)
+    long copy_stride; // bytes from one FAT copy to the next
+    uint32_t dirty_count; // sectors waiting for writeback
+    uint32_t logged_count; // sectors waiting for a checkpoint
+} FatCache;
+
+/* Set up an empty cache for a FAT of num_sectors sectors starting at base_offset,
+ * mirrored to num_copies copies spaced copy_stride bytes apart */
+bool fat_cache_init(FatCache *cache, uint32_t num_sectors, uint32_t sector_size, long base_offset,
+                    uint32_t num_copies, long copy_stride);
+
+/* Release cache memory. Dirty sectors are dropped, flush first */
+void fat_cache_free(FatCache *cache);
+
+/* Read entry 'index' into *value. Returns false if out of range or on I/O error */
+bool fat_cache_read(FatCache *cache, BlockDevice *image, uint32_t index, uint32_t *value);
+
+/* Set entry 'index' to value and mark its sector dirty */
+bool fat_cache_write(FatCache *cache, BlockDevice *image, uint32_t index, uint32_t value);
+
+/* Make sectors [first, first + count) resident and return a pointer to the
+ * first one. The pointer stays valid until fat_cache_free. NULL on I/O error */
+const unsigned char* fat_cache_sectors(FatCache *cache, BlockDevice *image, uint32_t first, uint32_t count);
+
+/* Zero 'count' consecutive entries from 'first', touching each sector once */
+bool fat_cache_clear_range(FatCache *cache, BlockDevice *image, uint32_t first, uint32_t count);
+
+/* Write every dirty or logged sector back to every FAT copy, one write per run
+ * of such sectors per copy */
+bool fat_cache_flush(FatCache *cache, BlockDevice *image);
+
+/* Add every dirty run, for every FAT copy, to a journal transaction. Once the
+ * transaction is in the log, fat_cache_logged() turns DIRTY into LOGGED */
+bool fat_cache_log(FatCache *cache, JournalTxn *txn);
+void fat_cache_logged(FatCache *cache);
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Vectorized scans over in-memory FAT entries (raw little-endian 32-bit
+ * entries as they sit in the FAT cache). An entry is free when its low 28
+ * bits are zero. The AVX2 or SSE2 version is picked at runtime from what the
+ * CPU supports, with a plain C fallback everywhere else.
+ */
+
+/* Pick the scan kernels for this CPU. Called once at mount, safe to call again */
+void fat_scan_init(void);
+
+/* Name of the kernel set in use ("avx2", "sse2" or "scalar") */
+const char* fat_scan_kernel(void);
+
+/* Index of the first free entry among 'count' entries, or 'count' if none */
+uint32_t fat_scan_first_free(const unsigned char *entries, uint32_t count);
+
+/* OR a used bit (1 = entry not free) for each of 'count' entries into 'words',
+ * entry i landing in bit (i % 64) of words[i / 64] */
+void fat_scan_used_bits(const unsigned char *entries, uint32_t count, uint64_t *words);
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * FatStats
+ * Counters gathered by a full pass over the FAT. Only the FAT is looked at,
+ * so "chains" counts end-of-chain markers (files, directories and any lost
+ * chains alike) and "fragments" counts links that do not point at the next
+ * cluster.
+ */
+typedef struct {
+    uint32_t free_clusters; // entries that are zero
+    uint32_t used_clusters; // entries in use, including bad and end-of-chain
+    uint32_t bad_clusters; // entries marked 0x0FFFFFF7
+    uint32_t chains; // end-of-chain entries
+    uint32_t fragments; // links to a cluster other than cluster + 1
+    uint32_t invalid_links; // links pointing outside the data region
+} FatStats;
+
+/*
+ * fat_stats_scan()
+ * Scans the in-memory FAT entries for clusters [0, end) and ORs a used bit per
+ * entry into 'words' (free map layout). When 'stats' is non-NULL it also fills
+ * in the counters for clusters 2 and up. The range is split into 'threads'
+ * pieces on 64-entry boundaries, so each worker owns whole bitmap words and
+ * its own counters; the counters are summed at the end.
+ */
+void fat_stats_scan(const unsigned char *fat, uint32_t end, uint64_t *words, FatStats *stats, unsigned threads);
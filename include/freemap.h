@@ -0,0 +1,45 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * FreeMap
+ * One bit per cluster (set = in use) covering clusters 0 .. total_clusters + 1,
+ * so a cluster number indexes the bitmap directly. Clusters 0 and 1 are
+ * reserved and always marked used. Built from the FAT and kept in step by the
+ * allocator, so finding a free cluster never has to touch the FAT.
+ *
+ * When the counts come from a trusted FSInfo sector the bitmap is not built
+ * at mount (bits == NULL). free_count and next_free are still maintained and
+ * the caller finds free clusters in the FAT itself until the map is built.
+ */
+typedef struct {
+    uint64_t *bits; // bitmap words, bit (c % 64) of word (c / 64) is cluster c
+    uint32_t num_bits; // total_clusters + 2
+    uint32_t free_count; // clusters currently free
+    uint32_t next_free; // rotating cursor, the next search starts here
+} FreeMap;
+
+/* Allocate a bitmap with every data cluster free. Returns false on OOM */
+bool free_map_init(FreeMap *map, uint32_t total_clusters);
+
+/* Counts only, no bitmap: start from a known free count and cursor (FSInfo) */
+void free_map_init_counts(FreeMap *map, uint32_t total_clusters, uint32_t free_count, uint32_t next_free);
+
+void free_map_free(FreeMap *map);
+
+/* Recompute free_count from the bitmap after bits were filled in directly */
+void free_map_recount(FreeMap *map);
+
+bool free_map_is_free(const FreeMap *map, uint32_t cluster);
+
+/* Flip a cluster's state, keeping free_count right. No-op if already in that state.
+ * Without a bitmap the caller must only report real transitions */
+void free_map_set_used(FreeMap *map, uint32_t cluster);
+void free_map_set_free(FreeMap *map, uint32_t cluster);
+
+/* Mark 'count' clusters from 'start' free in one pass over the bitmap words */
+void free_map_set_free_range(FreeMap *map, uint32_t start, uint32_t count);
+
+/* First free cluster at or after 'start', wrapping around once. 0 if full or no bitmap */
+uint32_t free_map_find(const FreeMap *map, uint32_t start);
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * IoRequest
+ * One read or write of len bytes at a byte offset of the image.
+ */
+typedef struct {
+    uint64_t offset;
+    void *buf;
+    uint32_t len;
+    bool write;
+} IoRequest;
+
+/*
+ * IoEngine
+ * io_uring instance on one file descriptor, driven through the raw syscalls.
+ * io_engine_run() keeps up to 'depth' requests in flight and returns once all
+ * of them are done. Short transfers and requests the kernel rejects are
+ * finished with plain pread/pwrite (from the last whole block on an O_DIRECT
+ * fd), so the result is the same as doing the whole batch synchronously.
+ */
+typedef struct {
+    int ring_fd; // -1 when not set up
+    int fd; // file the requests go to
+    uint32_t align; // block size if fd is opened O_DIRECT, 0 otherwise
+    unsigned depth; // submission queue entries
+    void *sq_ring; // mapped submission ring
+    void *cq_ring; // mapped completion ring, same as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    void *sqes; // mapped submission queue entries
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void *cqes;
+} IoEngine;
+
+/* default queue depth */
+#define IO_ENGINE_DEPTH 32
+
+/* Set up an io_uring for fd. 'align' is the block size an O_DIRECT fd needs
+ * (0 for a normal one). False if the kernel does not offer io_uring */
+bool io_engine_init(IoEngine *engine, int fd, unsigned depth, uint32_t align);
+void io_engine_free(IoEngine *engine);
+
+/* Run all requests to completion. False if any of them could not be done */
+bool io_engine_run(IoEngine *engine, IoRequest *reqs, uint32_t count);
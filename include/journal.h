@@ -0,0 +1,109 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "blockdev.h"
+
+/*
+ * Journal
+ * Write-ahead log of metadata blocks in a file next to the image
+ * (<image>.jnl). Every operation's FAT sectors and directory clusters go in
+ * as one transaction record, and only later, at a checkpoint, to their home
+ * location in the image. Records are made durable in groups, one fsync per
+ * JOURNAL_GROUP_RECORDS records. fs_mount replays whatever complete records
+ * are left after a crash, so the image gets all of an operation's metadata
+ * or none of it.
+ *
+ * File data is not logged, it is written in place before the records that
+ * point at it. For that order to hold on disk too, the image is synced
+ * before any fsync of the log that follows data writes (see
+ * journal_data_written()).
+ *
+ * On disk a record is a JournalHeader, 'count' JournalBlock descriptors and
+ * then the blocks' bytes back to back. The checksum covers all of it (with
+ * the checksum field zeroed), so a record cut short by a crash is ignored
+ * along with everything after it. The log is emptied after every checkpoint,
+ * there is no wrap around.
+ */
+
+#define JOURNAL_MAGIC 0x4C4E4A46 // "FJNL"
+
+/* records per group commit */
+#define JOURNAL_GROUP_RECORDS 8
+
+/* checkpoint once the log grows past this */
+#define JOURNAL_CHECKPOINT_BYTES (4 * 1024 * 1024)
+
+typedef struct {
+    uint32_t magic; // JOURNAL_MAGIC
+    uint32_t count; // JournalBlock descriptors that follow
+    uint64_t seq; // record number, consecutive within the log
+    uint64_t bytes; // size of the whole record, header included
+    uint64_t checksum; // FNV-1a over the record with this field 0
+} JournalHeader;
+
+typedef struct {
+    uint64_t offset; // image byte offset the block belongs at
+    uint32_t len; // bytes
+    uint32_t reserved;
+} JournalBlock;
+
+/*
+ * JournalTxn
+ * The blocks of one transaction while it is being gathered. The buffers are
+ * only borrowed (they point into the FAT and buffer caches) until
+ * journal_append() has copied them into the record.
+ */
+typedef struct {
+    IoRequest *blocks; // dynamically allocated, MUST BE FREED with journal_txn_free
+    uint32_t count;
+    uint32_t capacity;
+} JournalTxn;
+
+typedef struct {
+    int fd; // log file, -1 while journaling is off
+    uint64_t seq; // number of the next record
+    uint64_t size; // bytes in the log
+    uint32_t unsynced; // records written since the last fsync
+    BlockDevice *image; // synced ahead of the log when data_unsynced
+    bool data_unsynced; // file data written in place since the image was last synced
+} Journal;
+
+void journal_txn_init(JournalTxn *txn);
+void journal_txn_free(JournalTxn *txn);
+bool journal_txn_add(JournalTxn *txn, uint64_t offset, void *buf, uint32_t len);
+
+/* Open (creating it if needed) the log at path and start journaling the
+ * metadata of 'image' */
+bool journal_open(Journal *journal, const char *path, BlockDevice *image);
+void journal_close(Journal *journal);
+
+/* Journaling is on */
+bool journal_active(const Journal *journal);
+
+/*
+ * journal_replay()
+ * Writes the blocks of every complete record in the log at path into dev, in
+ * order, makes the image durable and empties the log. A missing or empty log
+ * is not an error. Returns the number of records replayed, -1 on I/O error.
+ */
+int journal_replay(const char *path, BlockDevice *dev);
+
+/* Append the transaction as one record. Every JOURNAL_GROUP_RECORDS records
+ * the log is fsynced, committing the whole group at once */
+bool journal_append(Journal *journal, const JournalTxn *txn);
+
+/* fsync the log if records were written since the last one, after syncing
+ * the image if file data went to it since */
+bool journal_commit(Journal *journal);
+
+/* File data was just written to the image in place */
+void journal_data_written(Journal *journal);
+
+/* Sync the image if file data was written to it since the last sync */
+bool journal_sync_data(Journal *journal);
+
+/* The log is big enough that a checkpoint is due */
+bool journal_full(const Journal *journal);
+
+/* Empty the log once every record in it has reached the image (and the image is durable) */
+bool journal_reset(Journal *journal);
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include "lexer.h"
+#include "extent.h"
 
 typedef struct { 
     char fileName[12]; // null terminated file name
@@ -12,6 +13,10 @@ typedef struct {
     uint32_t offset; //offset of the file "pointer" inside the file , used to calculate the position of the global filsystem pointer - intialized to 0
     int open; //if file is open, if 0 then file is closed and we can disregard this entry
     uint32_t startCluster; //start cluster of file, we use this to diff between files with same name in different directories
+    ExtentMap extents; //runs of the file's cluster chain, built on first read/write and grown by writes, freed on close
+    uint32_t raNext; //offset a sequential read would start at next, 0 on open
+    uint32_t raWindow; //readahead window in clusters, 0 while reads do not look sequential
+    uint32_t raEnd; //cluster index readahead has been issued up to
 } OpenFile;
 
 struct OpenFiles {
@@ -0,0 +1,774 @@
+#define _GNU_SOURCE // O_DIRECT, statx
+#include "blockdev.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <stdint.h>
+
+static bool in_range(const BlockDevice *dev, uint64_t offset, size_t len) {
+
+    return offset <= dev->size && len <= dev->size - offset;
+}
+
+/*
+ * full_pread() / full_pwrite()
+ * pread/pwrite until all of len is done, retrying short transfers and EINTR.
+ */
+static bool full_pread(int fd, void *buf, size_t len, uint64_t offset) {
+
+    unsigned char *p = (unsigned char *) buf;
+
+    while (len > 0) {
+
+        ssize_t n = pread(fd, p, len, (off_t)offset);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+
+    return true;
+}
+
+static bool full_pwrite(int fd, const void *buf, size_t len, uint64_t offset) {
+
+    const unsigned char *p = (const unsigned char *) buf;
+
+    while (len > 0) {
+
+        ssize_t n = pwrite(fd, p, len, (off_t)offset);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+
+    return true;
+}
+
+/*
+ * full_rwv()
+ * One preadv/pwritev over the buffers of 'count' requests that continue each
+ * other on disk, starting at reqs[0].offset. Short transfers pick up where
+ * they stopped.
+ */
+static bool full_rwv(int fd, const IoRequest *reqs, uint32_t count) {
+
+    struct iovec iov[BLOCKDEV_MAX_IOV];
+    struct iovec *v = iov;
+    uint64_t offset = reqs[0].offset;
+    bool write = reqs[0].write;
+
+    for (uint32_t i = 0; i < count; i++) {
+        iov[i].iov_base = reqs[i].buf;
+        iov[i].iov_len = reqs[i].len;
+    }
+
+    while (count > 0) {
+
+        ssize_t n = write ? pwritev(fd, v, (int)count, (off_t)offset) : preadv(fd, v, (int)count, (off_t)offset);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        offset += (uint64_t)n;
+
+        //drop the buffers that are done and trim a partly done one
+        while (count > 0 && (size_t)n >= v->iov_len) {
+            n -= (ssize_t)v->iov_len;
+            v++;
+            count--;
+        }
+
+        if (count > 0) {
+            v->iov_base = (unsigned char *) v->iov_base + n;
+            v->iov_len -= (size_t)n;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * run_length()
+ * How many requests from reqs[0] on continue each other on disk in the same
+ * direction, at most BLOCKDEV_MAX_IOV, so they can go out as one vectored call.
+ */
+static uint32_t run_length(const IoRequest *reqs, uint32_t count) {
+
+    uint64_t end = reqs[0].offset + reqs[0].len;
+    uint32_t n = 1;
+
+    while (n < count && n < BLOCKDEV_MAX_IOV && reqs[n].write == reqs[0].write && reqs[n].offset == end) {
+        end += reqs[n].len;
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * write_all()
+ * write() until all of len is out, for descriptors that take no offset.
+ */
+static bool write_all(int fd, const unsigned char *p, size_t len) {
+
+    while (len > 0) {
+
+        ssize_t n = write(fd, p, len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        p += n;
+        len -= (size_t)n;
+    }
+
+    return true;
+}
+
+/*
+ * fd_copy_out()
+ * Copy-out for the backends with an image file behind them. copy_file_range
+ * handles regular files (and may share blocks on reflink file systems),
+ * sendfile pipes and sockets. Only a target neither of them takes gets the
+ * data bounced through user space. The mmap backend can use this as well,
+ * MAP_SHARED writes are already in the page cache the kernel copies from.
+ */
+static bool fd_copy_out(BlockDevice *dev, uint64_t offset, size_t len, int out_fd) {
+
+    if (!in_range(dev, offset, len))
+        return false;
+
+    bool use_range = true;
+    bool use_sendfile = true;
+
+    while (len > 0) {
+
+        ssize_t n;
+
+        if (use_range) {
+
+            loff_t from = (loff_t)offset;
+            n = copy_file_range(dev->fd, &from, out_fd, NULL, len, 0);
+
+            //not between these two files, let sendfile have a go
+            if (n < 0 && errno != EINTR && errno != EIO && errno != ENOSPC) {
+                use_range = false;
+                continue;
+            }
+        }
+        else if (use_sendfile) {
+
+            off_t from = (off_t)offset;
+            n = sendfile(out_fd, dev->fd, &from, len);
+
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                use_sendfile = false;
+                continue;
+            }
+        }
+        else {
+
+            unsigned char buf[16 * 1024];
+            size_t chunk = (len < sizeof(buf)) ? len : sizeof(buf);
+
+            if (!full_pread(dev->fd, buf, chunk, offset) || !write_all(out_fd, buf, chunk))
+                return false;
+
+            n = (ssize_t)chunk;
+        }
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        offset += (uint64_t)n;
+        len -= (size_t)n;
+    }
+
+    return true;
+}
+
+/*
+ * pread backend: every call is one positional syscall, there is no user-space
+ * buffer to flush.
+ */
+static bool pread_read(BlockDevice *dev, uint64_t offset, void *buf, size_t len) {
+
+    return in_range(dev, offset, len) && full_pread(dev->fd, buf, len, offset);
+}
+
+static bool pread_write(BlockDevice *dev, uint64_t offset, const void *buf, size_t len) {
+
+    return in_range(dev, offset, len) && full_pwrite(dev->fd, buf, len, offset);
+}
+
+static bool pread_submit(BlockDevice *dev, IoRequest *reqs, uint32_t count) {
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!in_range(dev, reqs[i].offset, reqs[i].len))
+            return false;
+    }
+
+    if (dev->async)
+        return io_engine_run(&dev->engine, reqs, count);
+
+    bool ok = true;
+    uint32_t n;
+
+    for (uint32_t i = 0; i < count; i += n) {
+        n = run_length(reqs + i, count - i);
+        ok = full_rwv(dev->fd, reqs + i, n) && ok;
+    }
+
+    return ok;
+}
+
+static bool pread_readahead(BlockDevice *dev, uint64_t offset, size_t len) {
+
+    return posix_fadvise(dev->fd, (off_t)offset, (off_t)len, POSIX_FADV_WILLNEED) == 0;
+}
+
+static bool pread_flush(BlockDevice *dev) {
+
+    (void) dev;
+    return true;
+}
+
+static bool pread_sync(BlockDevice *dev) {
+
+    return fsync(dev->fd) == 0;
+}
+
+static void pread_close(BlockDevice *dev) {
+
+    if (dev->async)
+        io_engine_free(&dev->engine);
+}
+
+static const BlockDeviceOps pread_ops = {
+    "pread", pread_read, pread_write, pread_submit, NULL, pread_readahead, fd_copy_out, pread_flush, pread_sync, pread_close
+};
+
+/*
+ * Shared by the mmap and memory backends: the image is at dev->data.
+ */
+static bool image_read(BlockDevice *dev, uint64_t offset, void *buf, size_t len) {
+
+    if (!in_range(dev, offset, len))
+        return false;
+
+    memcpy(buf, dev->data + offset, len);
+    return true;
+}
+
+static const unsigned char* image_map(BlockDevice *dev, uint64_t offset, size_t len) {
+
+    return in_range(dev, offset, len) ? dev->data + offset : NULL;
+}
+
+/*
+ * mmap backend: MAP_SHARED, so writes are in the page cache as soon as the
+ * memcpy is done and msync decides when they reach the disk.
+ */
+static bool mmap_write(BlockDevice *dev, uint64_t offset, const void *buf, size_t len) {
+
+    if (!in_range(dev, offset, len))
+        return false;
+
+    memcpy(dev->data + offset, buf, len);
+    return true;
+}
+
+static bool mmap_readahead(BlockDevice *dev, uint64_t offset, size_t len) {
+
+    //madvise wants a page aligned start
+    uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t start = offset - offset % page;
+
+    if (!in_range(dev, offset, len))
+        return false;
+
+    return madvise(dev->data + start, (size_t)(offset + len - start), MADV_WILLNEED) == 0;
+}
+
+static bool mmap_flush(BlockDevice *dev) {
+
+    return msync(dev->data, dev->size, MS_ASYNC) == 0;
+}
+
+static bool mmap_sync(BlockDevice *dev) {
+
+    return msync(dev->data, dev->size, MS_SYNC) == 0;
+}
+
+static void mmap_close(BlockDevice *dev) {
+
+    munmap(dev->data, dev->size);
+}
+
+static const BlockDeviceOps mmap_ops = {
+    "mmap", image_read, mmap_write, NULL, image_map, mmap_readahead, fd_copy_out, mmap_flush, mmap_sync, mmap_close
+};
+
+/*
+ * memory backend: a private copy of the image. Writes only widen the dirty
+ * span, sync writes that span back in one pwrite.
+ */
+static bool memory_write(BlockDevice *dev, uint64_t offset, const void *buf, size_t len) {
+
+    if (!in_range(dev, offset, len))
+        return false;
+
+    memcpy(dev->data + offset, buf, len);
+
+    if (dev->dirty_hi == 0 || offset < dev->dirty_lo)
+        dev->dirty_lo = offset;
+    if (offset + len > dev->dirty_hi)
+        dev->dirty_hi = offset + len;
+
+    return true;
+}
+
+static bool memory_copy_out(BlockDevice *dev, uint64_t offset, size_t len, int out_fd) {
+
+    //the file on disk may be behind, the copy in memory is what counts
+    return in_range(dev, offset, len) && write_all(out_fd, dev->data + offset, len);
+}
+
+static bool memory_flush(BlockDevice *dev) {
+
+    (void) dev;
+    return true;
+}
+
+static bool memory_sync(BlockDevice *dev) {
+
+    if (dev->dirty_hi > dev->dirty_lo) {
+
+        if (!full_pwrite(dev->fd, dev->data + dev->dirty_lo, dev->dirty_hi - dev->dirty_lo, dev->dirty_lo))
+            return false;
+
+        dev->dirty_lo = 0;
+        dev->dirty_hi = 0;
+    }
+
+    return fsync(dev->fd) == 0;
+}
+
+static void memory_close(BlockDevice *dev) {
+
+    free(dev->data);
+}
+
+static const BlockDeviceOps memory_ops = {
+    "memory", image_read, memory_write, NULL, image_map, NULL, memory_copy_out, memory_flush, memory_sync, memory_close
+};
+
+/*
+ * direct backend: the same positional calls on an O_DIRECT descriptor. The
+ * kernel only takes whole aligned blocks into aligned memory, so everything
+ * else is staged in the bounce block, one DIRECT_BOUNCE_BYTES chunk at a
+ * time. A write only has to read the two partial blocks at its ends first.
+ * The image tail past the last whole block is left to the buffered fd, an
+ * O_DIRECT write there would have to grow the file.
+ */
+static bool is_aligned(const BlockDevice *dev, uint64_t offset, const void *buf, size_t len) {
+
+    uint64_t mask = dev->align - 1;
+
+    return ((offset | (uint64_t)len | (uint64_t)(uintptr_t)buf) & mask) == 0;
+}
+
+static uint64_t align_up(const BlockDevice *dev, uint64_t value) {
+
+    return (value + dev->align - 1) & ~((uint64_t)dev->align - 1);
+}
+
+static bool direct_rw(BlockDevice *dev, uint64_t offset, unsigned char *buf, size_t len, bool write) {
+
+    if (!in_range(dev, offset, len))
+        return false;
+
+    uint64_t end = offset + len;
+
+    if (end > dev->direct_end) {
+
+        uint64_t from = (offset > dev->direct_end) ? offset : dev->direct_end;
+        unsigned char *p = buf + (from - offset);
+
+        if (write ? !full_pwrite(dev->fd, p, end - from, from) : !full_pread(dev->fd, p, end - from, from))
+            return false;
+
+        if (offset >= dev->direct_end)
+            return true;
+
+        end = dev->direct_end;
+    }
+
+    if (is_aligned(dev, offset, buf, end - offset)) {
+        return write ? full_pwrite(dev->direct_fd, buf, end - offset, offset)
+                     : full_pread(dev->direct_fd, buf, end - offset, offset);
+    }
+
+    uint64_t last = align_up(dev, end);
+
+    while (offset < end) {
+
+        uint64_t chunk = offset & ~((uint64_t)dev->align - 1);
+        uint64_t chunk_end = chunk + DIRECT_BOUNCE_BYTES;
+
+        if (chunk_end > last)
+            chunk_end = last;
+
+        uint64_t stop = (end < chunk_end) ? end : chunk_end;
+        size_t chunk_len = (size_t)(chunk_end - chunk);
+
+        if (!write) {
+
+            if (!full_pread(dev->direct_fd, dev->bounce, chunk_len, chunk))
+                return false;
+
+            memcpy(buf, dev->bounce + (offset - chunk), stop - offset);
+        }
+        else {
+
+            uint64_t tail = chunk_end - dev->align;
+
+            //partial blocks at either end keep the bytes the write does not cover
+            if (offset > chunk && !full_pread(dev->direct_fd, dev->bounce, dev->align, chunk))
+                return false;
+            if (stop < chunk_end && !full_pread(dev->direct_fd, dev->bounce + (tail - chunk), dev->align, tail))
+                return false;
+
+            memcpy(dev->bounce + (offset - chunk), buf, stop - offset);
+
+            if (!full_pwrite(dev->direct_fd, dev->bounce, chunk_len, chunk))
+                return false;
+        }
+
+        buf += stop - offset;
+        offset = stop;
+    }
+
+    return true;
+}
+
+static bool direct_read(BlockDevice *dev, uint64_t offset, void *buf, size_t len) {
+
+    return direct_rw(dev, offset, (unsigned char *) buf, len, false);
+}
+
+static bool direct_write(BlockDevice *dev, uint64_t offset, const void *buf, size_t len) {
+
+    //only read from on the write path, the cast is for the shared helper
+    return direct_rw(dev, offset, (unsigned char *)(uintptr_t) buf, len, true);
+}
+
+//whole aligned blocks below direct_end, the only thing direct_fd takes as is
+static bool direct_fits(const BlockDevice *dev, const IoRequest *req) {
+
+    return is_aligned(dev, req->offset, req->buf, req->len) && req->offset + req->len <= dev->direct_end;
+}
+
+static bool direct_submit(BlockDevice *dev, IoRequest *reqs, uint32_t count) {
+
+    bool ring = dev->async;
+
+    for (uint32_t i = 0; i < count; i++) {
+
+        if (!in_range(dev, reqs[i].offset, reqs[i].len))
+            return false;
+
+        if (!direct_fits(dev, &reqs[i]))
+            ring = false;
+    }
+
+    if (ring)
+        return io_engine_run(&dev->engine, reqs, count);
+
+    bool ok = true;
+    uint32_t n;
+
+    for (uint32_t i = 0; i < count; i += n) {
+
+        if (!direct_fits(dev, &reqs[i])) {
+            n = 1;
+            ok = direct_rw(dev, reqs[i].offset, (unsigned char *) reqs[i].buf, reqs[i].len, reqs[i].write) && ok;
+            continue;
+        }
+
+        n = run_length(reqs + i, count - i);
+
+        for (uint32_t k = 1; k < n; k++) {
+            if (!direct_fits(dev, &reqs[i + k])) {
+                n = k;
+                break;
+            }
+        }
+
+        ok = full_rwv(dev->direct_fd, reqs + i, n) && ok;
+    }
+
+    return ok;
+}
+
+static void direct_close(BlockDevice *dev) {
+
+    if (dev->async)
+        io_engine_free(&dev->engine);
+
+    free(dev->bounce);
+    close(dev->direct_fd);
+}
+
+static const BlockDeviceOps direct_ops = {
+    "direct", direct_read, direct_write, direct_submit, NULL, NULL, fd_copy_out, pread_flush, pread_sync, direct_close
+};
+
+/*
+ * direct_alignment()
+ * What the file system wants for O_DIRECT on fd, the larger of the offset and
+ * memory alignments. Kernels without STATX_DIOALIGN get a conservative 4096.
+ */
+static uint32_t direct_alignment(int fd) {
+
+    uint32_t align = 4096;
+
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+        (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align != 0) {
+
+        align = stx.stx_dio_offset_align;
+
+        if (stx.stx_dio_mem_align > align)
+            align = stx.stx_dio_mem_align;
+    }
+#endif
+
+    return align;
+}
+
+/*
+ * open_direct()
+ * Sets dev up as the direct backend. False leaves dev untouched apart from
+ * direct_fd, and the caller falls back to the pread backend.
+ */
+static bool open_direct(BlockDevice *dev, const char *path) {
+
+    dev->direct_fd = open(path, O_RDWR | O_DIRECT);
+
+    if (dev->direct_fd < 0)
+        return false;
+
+    uint32_t align = direct_alignment(dev->direct_fd);
+    void *bounce = NULL;
+
+    //a power of two no larger than the bounce block, or the chunk arithmetic breaks
+    if ((align & (align - 1)) != 0 || align > DIRECT_BOUNCE_BYTES ||
+        posix_memalign(&bounce, align, DIRECT_BOUNCE_BYTES) != 0) {
+        close(dev->direct_fd);
+        dev->direct_fd = -1;
+        return false;
+    }
+
+    dev->align = align;
+    dev->direct_end = dev->size & ~((uint64_t)align - 1);
+    dev->bounce = (unsigned char *) bounce;
+    dev->ops = &direct_ops;
+
+    return true;
+}
+
+BlockDevice* blockdev_open(const char *path, BlockDevKind kind) {
+
+    BlockDevice *dev = (BlockDevice *) calloc(1, sizeof(BlockDevice));
+
+    if (!dev)
+        return NULL;
+
+    dev->direct_fd = -1;
+    dev->align = 1;
+    dev->fd = open(path, O_RDWR);
+
+    struct stat st;
+
+    if (dev->fd < 0 || fstat(dev->fd, &st) != 0 || st.st_size <= 0)
+        goto fail;
+
+    dev->size = (uint64_t)st.st_size;
+
+    switch (kind) {
+
+        case BLOCKDEV_MMAP: {
+            void *p = mmap(NULL, (size_t)dev->size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+
+            if (p == MAP_FAILED)
+                goto fail;
+
+            dev->data = (unsigned char *) p;
+            dev->ops = &mmap_ops;
+            break;
+        }
+
+        case BLOCKDEV_MEMORY:
+            dev->data = (unsigned char *) malloc((size_t)dev->size);
+
+            if (!dev->data || !full_pread(dev->fd, dev->data, (size_t)dev->size, 0)) {
+                free(dev->data);
+                goto fail;
+            }
+
+            dev->ops = &memory_ops;
+            break;
+
+        case BLOCKDEV_DIRECT:
+            //tmpfs and some network file systems refuse O_DIRECT
+            if (!open_direct(dev, path))
+                dev->ops = &pread_ops;
+            break;
+
+        default:
+            dev->ops = &pread_ops;
+            break;
+    }
+
+    return dev;
+
+fail:
+    if (dev->fd >= 0)
+        close(dev->fd);
+    free(dev);
+    return NULL;
+}
+
+bool blockdev_kind_from_name(const char *name, BlockDevKind *kind) {
+
+    if (strcmp(name, "pread") == 0)
+        *kind = BLOCKDEV_PREAD;
+    else if (strcmp(name, "mmap") == 0)
+        *kind = BLOCKDEV_MMAP;
+    else if (strcmp(name, "memory") == 0)
+        *kind = BLOCKDEV_MEMORY;
+    else if (strcmp(name, "direct") == 0)
+        *kind = BLOCKDEV_DIRECT;
+    else
+        return false;
+
+    return true;
+}
+
+const char* blockdev_name(const BlockDevice *dev) {
+
+    return dev->ops->name;
+}
+
+void blockdev_close(BlockDevice *dev) {
+
+    if (!dev)
+        return;
+
+    dev->ops->sync(dev);
+    dev->ops->close(dev);
+    close(dev->fd);
+    free(dev);
+}
+
+size_t blockdev_alignment(const BlockDevice *dev) {
+
+    return dev->align;
+}
+
+bool blockdev_read(BlockDevice *dev, uint64_t offset, void *buf, size_t len) {
+
+    return dev->ops->read(dev, offset, buf, len);
+}
+
+bool blockdev_write(BlockDevice *dev, uint64_t offset, const void *buf, size_t len) {
+
+    return dev->ops->write(dev, offset, buf, len);
+}
+
+const unsigned char* blockdev_map(BlockDevice *dev, uint64_t offset, size_t len) {
+
+    return dev->ops->map ? dev->ops->map(dev, offset, len) : NULL;
+}
+
+bool blockdev_readahead(BlockDevice *dev, uint64_t offset, size_t len) {
+
+    return dev->ops->readahead ? dev->ops->readahead(dev, offset, len) : false;
+}
+
+bool blockdev_copy_out(BlockDevice *dev, uint64_t offset, size_t len, int out_fd) {
+
+    return dev->ops->copy_out(dev, offset, len, out_fd);
+}
+
+bool blockdev_submit(BlockDevice *dev, IoRequest *reqs, uint32_t count) {
+
+    if (dev->ops->submit)
+        return dev->ops->submit(dev, reqs, count);
+
+    bool ok = true;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (reqs[i].write)
+            ok = dev->ops->write(dev, reqs[i].offset, reqs[i].buf, reqs[i].len) && ok;
+        else
+            ok = dev->ops->read(dev, reqs[i].offset, reqs[i].buf, reqs[i].len) && ok;
+    }
+
+    return ok;
+}
+
+bool blockdev_enable_async(BlockDevice *dev, unsigned depth) {
+
+    //mapped images complete every request with a memcpy, a ring would only add overhead
+    if ((dev->ops != &pread_ops && dev->ops != &direct_ops) || dev->async)
+        return dev->async;
+
+    bool direct = (dev->ops == &direct_ops);
+
+    dev->async = io_engine_init(&dev->engine, direct ? dev->direct_fd : dev->fd, depth, direct ? dev->align : 0);
+
+    return dev->async;
+}
+
+bool blockdev_is_async(const BlockDevice *dev) {
+
+    return dev->async;
+}
+
+bool blockdev_flush(BlockDevice *dev) {
+
+    return dev->ops->flush(dev);
+}
+
+bool blockdev_sync(BlockDevice *dev) {
+
+    return dev->ops->sync(dev);
+}
@@ -0,0 +1,603 @@
+#define _POSIX_C_SOURCE 200112L // posix_memalign
+#include "bufcache.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BUF_NONE 0xFFFFFFFFu
+
+static uint32_t bucket_of(const BufCache *cache, uint32_t cluster) {
+
+    return (cluster * 2654435761u) & cache->bucket_mask;
+}
+
+static unsigned char* entry_data(const BufCache *cache, uint32_t idx) {
+
+    return cache->data + (size_t)idx * cache->cluster_size;
+}
+
+static uint64_t cluster_offset(const BufCache *cache, uint32_t cluster) {
+
+    return cache->data_offset + (uint64_t)(cluster - 2) * cache->cluster_size;
+}
+
+static uint32_t lookup(const BufCache *cache, uint32_t cluster) {
+
+    for (uint32_t i = cache->buckets[bucket_of(cache, cluster)]; i != BUF_NONE; i = cache->entries[i].hash_next) {
+        if (cache->entries[i].cluster == cluster)
+            return i;
+    }
+
+    return BUF_NONE;
+}
+
+static void hash_insert(BufCache *cache, uint32_t idx) {
+
+    uint32_t b = bucket_of(cache, cache->entries[idx].cluster);
+
+    cache->entries[idx].hash_next = cache->buckets[b];
+    cache->buckets[b] = idx;
+}
+
+static void hash_remove(BufCache *cache, uint32_t idx) {
+
+    uint32_t *link = &cache->buckets[bucket_of(cache, cache->entries[idx].cluster)];
+
+    while (*link != idx)
+        link = &cache->entries[*link].hash_next;
+
+    *link = cache->entries[idx].hash_next;
+}
+
+/* move an entry to the most recently used end of the LRU list */
+static void touch(BufCache *cache, uint32_t idx) {
+
+    if (cache->lru_head == idx)
+        return;
+
+    BufEntry *e = &cache->entries[idx];
+
+    //unlink, idx is not the head so it has a prev
+    cache->entries[e->lru_prev].lru_next = e->lru_next;
+
+    if (e->lru_next != BUF_NONE)
+        cache->entries[e->lru_next].lru_prev = e->lru_prev;
+    else
+        cache->lru_tail = e->lru_prev;
+
+    e->lru_prev = BUF_NONE;
+    e->lru_next = cache->lru_head;
+    cache->entries[cache->lru_head].lru_prev = idx;
+    cache->lru_head = idx;
+}
+
+/*
+ * held() / unwritten()
+ * With a journal, a dirty directory cluster is part of a transaction that
+ * is not in the log yet: it may neither be written in place nor evicted.
+ * Once logged it may go home, but only after the log is durable.
+ */
+static bool held(const BufCache *cache, const BufEntry *e) {
+
+    return cache->journal && e->meta && e->dirty;
+}
+
+static bool unwritten(const BufCache *cache, const BufEntry *e) {
+
+    return (e->dirty || e->logged) && !held(cache, e);
+}
+
+static bool needs_write(const BufCache *cache, uint32_t cluster) {
+
+    uint32_t idx = lookup(cache, cluster);
+
+    return idx != BUF_NONE && unwritten(cache, &cache->entries[idx]);
+}
+
+//entry is at its home location again
+static void mark_written(BufCache *cache, uint32_t idx) {
+
+    BufEntry *e = &cache->entries[idx];
+
+    if (e->dirty)
+        cache->dirty_count--;
+    if (e->logged)
+        cache->logged_count--;
+
+    e->dirty = false;
+    e->logged = false;
+}
+
+/*
+ * write_back()
+ * Writes an entry back together with the cached clusters right before and
+ * after it on disk that need writing too (up to BUF_WRITE_RUN_MAX in all),
+ * which the device turns into one vectored write. Evicting one cluster of a
+ * file being streamed out so costs one call for the whole run.
+ */
+static bool write_back(BufCache *cache, uint32_t idx) {
+
+    BufEntry *e = &cache->entries[idx];
+
+    if (!unwritten(cache, e))
+        return true;
+
+    uint32_t lo = e->cluster;
+    uint32_t hi = e->cluster;
+
+    while (hi - lo + 1 < BUF_WRITE_RUN_MAX && lo > 2 && needs_write(cache, lo - 1))
+        lo--;
+    while (hi - lo + 1 < BUF_WRITE_RUN_MAX && hi < 0x0FFFFFF0 && needs_write(cache, hi + 1))
+        hi++;
+
+    IoRequest reqs[BUF_WRITE_RUN_MAX];
+    uint32_t slots[BUF_WRITE_RUN_MAX];
+    uint32_t n = 0;
+    bool logged = false;
+    bool data = false;
+
+    for (uint32_t cluster = lo; cluster <= hi; cluster++, n++) {
+        slots[n] = lookup(cache, cluster);
+        logged = logged || cache->entries[slots[n]].logged;
+        data = data || !cache->entries[slots[n]].meta;
+        reqs[n].offset = cluster_offset(cache, cluster);
+        reqs[n].buf = entry_data(cache, slots[n]);
+        reqs[n].len = cache->cluster_size;
+        reqs[n].write = true;
+    }
+
+    //a logged block may only overwrite its home once the record is durable
+    if (logged && !journal_commit(cache->journal))
+        return false;
+
+    //records logged from now on may point at this data
+    if (data && cache->journal)
+        journal_data_written(cache->journal);
+
+    if (!blockdev_submit(cache->dev, reqs, n))
+        return false;
+
+    for (uint32_t i = 0; i < n; i++)
+        mark_written(cache, slots[i]);
+
+    return true;
+}
+
+static void drop_entry(BufCache *cache, uint32_t idx) {
+
+    BufEntry *e = &cache->entries[idx];
+
+    if (e->dirty)
+        cache->dirty_count--;
+    if (e->logged)
+        cache->logged_count--;
+
+    hash_remove(cache, idx);
+    e->cluster = 0;
+    e->pins = 0;
+    e->dirty = false;
+    e->meta = false;
+    e->logged = false;
+}
+
+/*
+ * get_entry()
+ * Entry holding 'cluster', made from the least recently used unpinned and
+ * not held entry on a miss (written back first if needed). 'load' is false when the caller
+ * is about to overwrite the whole cluster. BUF_NONE on failure.
+ */
+static uint32_t get_entry(BufCache *cache, uint32_t cluster, bool load) {
+
+    if (cluster < 2)
+        return BUF_NONE;
+
+    uint32_t idx = lookup(cache, cluster);
+
+    if (idx != BUF_NONE) {
+        touch(cache, idx);
+        return idx;
+    }
+
+    for (idx = cache->lru_tail; idx != BUF_NONE; idx = cache->entries[idx].lru_prev) {
+        if (cache->entries[idx].pins == 0 && !held(cache, &cache->entries[idx]))
+            break;
+    }
+
+    if (idx == BUF_NONE)
+        return BUF_NONE;
+
+    BufEntry *e = &cache->entries[idx];
+
+    if (e->cluster != 0) {
+
+        if (!write_back(cache, idx))
+            return BUF_NONE;
+
+        drop_entry(cache, idx);
+    }
+
+    if (load && !blockdev_read(cache->dev, cluster_offset(cache, cluster), entry_data(cache, idx), cache->cluster_size))
+        return BUF_NONE;
+
+    e->cluster = cluster;
+    hash_insert(cache, idx);
+    touch(cache, idx);
+
+    return idx;
+}
+
+bool buf_cache_init(BufCache *cache, BlockDevice *dev, uint64_t data_offset, uint32_t cluster_size, size_t budget_bytes,
+                    Journal *journal) {
+
+    memset(cache, 0, sizeof(*cache));
+
+    cache->dev = dev;
+    cache->data_offset = data_offset;
+    cache->cluster_size = cluster_size;
+    cache->journal = (journal && journal_active(journal)) ? journal : NULL;
+
+    //the device already has the whole image in memory, copying it again buys nothing,
+    //unless directory writes have to wait for the journal
+    if (!cache->journal && blockdev_map(dev, data_offset, 0)) {
+        cache->direct = true;
+        return true;
+    }
+
+    if (budget_bytes == 0)
+        budget_bytes = BUF_CACHE_DEFAULT_BYTES;
+
+    size_t n = budget_bytes / cluster_size;
+
+    if (n < BUF_CACHE_MIN_ENTRIES)
+        n = BUF_CACHE_MIN_ENTRIES;
+    if (n > 0x1000000)
+        n = 0x1000000;
+
+    uint32_t buckets = 1;
+
+    while (buckets < n * 2)
+        buckets <<= 1;
+
+    cache->num_entries = (uint32_t)n;
+    cache->bucket_mask = buckets - 1;
+
+    //O_DIRECT devices move whole clusters straight in and out of aligned entries
+    size_t align = blockdev_alignment(dev);
+
+    if (align > 1) {
+        void *p = NULL;
+        cache->data = (posix_memalign(&p, align, n * cluster_size) == 0) ? (unsigned char *) p : NULL;
+    }
+    else {
+        cache->data = (unsigned char *) malloc(n * cluster_size);
+    }
+
+    cache->entries = (BufEntry *) calloc(n, sizeof(BufEntry));
+    cache->buckets = (uint32_t *) malloc(buckets * sizeof(uint32_t));
+
+    if (!cache->data || !cache->entries || !cache->buckets) {
+        buf_cache_free(cache);
+        return false;
+    }
+
+    for (uint32_t b = 0; b < buckets; b++)
+        cache->buckets[b] = BUF_NONE;
+
+    //every entry is always on the LRU list, unused ones start out in index order
+    for (uint32_t i = 0; i < n; i++) {
+        cache->entries[i].hash_next = BUF_NONE;
+        cache->entries[i].lru_prev = (i == 0) ? BUF_NONE : i - 1;
+        cache->entries[i].lru_next = (i + 1 == n) ? BUF_NONE : i + 1;
+    }
+
+    cache->lru_head = 0;
+    cache->lru_tail = (uint32_t)n - 1;
+
+    return true;
+}
+
+void buf_cache_free(BufCache *cache) {
+
+    free(cache->data);
+    free(cache->entries);
+    free(cache->buckets);
+    memset(cache, 0, sizeof(*cache));
+}
+
+const unsigned char* buf_cache_pin(BufCache *cache, uint32_t cluster) {
+
+    if (cache->direct)
+        return (cluster < 2) ? NULL : blockdev_map(cache->dev, cluster_offset(cache, cluster), cache->cluster_size);
+
+    uint32_t idx = get_entry(cache, cluster, true);
+
+    if (idx == BUF_NONE)
+        return NULL;
+
+    cache->entries[idx].pins++;
+
+    return entry_data(cache, idx);
+}
+
+void buf_cache_unpin(BufCache *cache, uint32_t cluster) {
+
+    if (cache->direct)
+        return;
+
+    uint32_t idx = lookup(cache, cluster);
+
+    if (idx != BUF_NONE && cache->entries[idx].pins > 0)
+        cache->entries[idx].pins--;
+}
+
+bool buf_cache_read(BufCache *cache, uint32_t cluster, uint32_t offset, void *dst, uint32_t len) {
+
+    if (cluster < 2 || offset > cache->cluster_size || len > cache->cluster_size - offset)
+        return false;
+
+    if (cache->direct)
+        return blockdev_read(cache->dev, cluster_offset(cache, cluster) + offset, dst, len);
+
+    uint32_t idx = get_entry(cache, cluster, true);
+
+    if (idx == BUF_NONE)
+        return false;
+
+    memcpy(dst, entry_data(cache, idx) + offset, len);
+
+    return true;
+}
+
+static bool write_entry(BufCache *cache, uint32_t cluster, uint32_t offset, const void *src, uint32_t len, bool meta) {
+
+    if (cluster < 2 || offset > cache->cluster_size || len > cache->cluster_size - offset)
+        return false;
+
+    if (cache->direct)
+        return blockdev_write(cache->dev, cluster_offset(cache, cluster) + offset, src, len);
+
+    bool whole = (offset == 0 && len == cache->cluster_size);
+    uint32_t idx = get_entry(cache, cluster, !whole);
+
+    if (idx == BUF_NONE)
+        return false;
+
+    memcpy(entry_data(cache, idx) + offset, src, len);
+
+    if (!cache->entries[idx].dirty) {
+        cache->entries[idx].dirty = true;
+        cache->dirty_count++;
+    }
+
+    //a cluster holding directory entries stays metadata until it is dropped
+    if (meta)
+        cache->entries[idx].meta = true;
+
+    return true;
+}
+
+bool buf_cache_write(BufCache *cache, uint32_t cluster, uint32_t offset, const void *src, uint32_t len) {
+
+    return write_entry(cache, cluster, offset, src, len, false);
+}
+
+bool buf_cache_write_meta(BufCache *cache, uint32_t cluster, uint32_t offset, const void *src, uint32_t len) {
+
+    return write_entry(cache, cluster, offset, src, len, true);
+}
+
+bool buf_cache_prefetch(BufCache *cache, const uint32_t *clusters, uint32_t count) {
+
+    if (cache->direct || count == 0)
+        return true;
+
+    if (count > cache->num_entries / 2)
+        count = cache->num_entries / 2;
+
+    IoRequest *reqs = (IoRequest *) malloc(count * sizeof(IoRequest));
+    uint32_t *slots = (uint32_t *) malloc(count * sizeof(uint32_t));
+
+    if (!reqs || !slots) {
+        free(reqs);
+        free(slots);
+        return true; //nothing loaded, later pins read on demand
+    }
+
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+
+        uint32_t cluster = clusters[i];
+
+        if (cluster < 2 || lookup(cache, cluster) != BUF_NONE)
+            continue;
+
+        uint32_t idx = get_entry(cache, cluster, false);
+
+        if (idx == BUF_NONE)
+            break;
+
+        //held until the batch is done so the rest of the batch cannot take it back
+        cache->entries[idx].pins++;
+
+        slots[n] = idx;
+        reqs[n].offset = cluster_offset(cache, cluster);
+        reqs[n].buf = entry_data(cache, idx);
+        reqs[n].len = cache->cluster_size;
+        reqs[n].write = false;
+        n++;
+    }
+
+    bool ok = blockdev_submit(cache->dev, reqs, n);
+
+    for (uint32_t i = 0; i < n; i++) {
+
+        cache->entries[slots[i]].pins--;
+
+        //contents never arrived, the entry must not be mistaken for the cluster
+        if (!ok)
+            drop_entry(cache, slots[i]);
+    }
+
+    free(reqs);
+    free(slots);
+
+    return ok;
+}
+
+void buf_cache_invalidate(BufCache *cache, uint32_t first, uint32_t count) {
+
+    if (cache->direct)
+        return;
+
+    //few clusters: look each one up, otherwise one pass over the entries
+    if (count <= cache->num_entries) {
+
+        for (uint32_t c = first; c < first + count; c++) {
+
+            uint32_t idx = lookup(cache, c);
+
+            if (idx != BUF_NONE)
+                drop_entry(cache, idx);
+        }
+
+        return;
+    }
+
+    for (uint32_t i = 0; i < cache->num_entries; i++) {
+
+        uint32_t c = cache->entries[i].cluster;
+
+        if (c != 0 && c >= first && c - first < count)
+            drop_entry(cache, i);
+    }
+}
+
+static const BufCache *sort_cache;
+
+static int by_cluster(const void *a, const void *b) {
+
+    uint32_t ca = sort_cache->entries[*(const uint32_t *)a].cluster;
+    uint32_t cb = sort_cache->entries[*(const uint32_t *)b].cluster;
+
+    return (ca > cb) - (ca < cb);
+}
+
+/*
+ * flush_entries()
+ * Writes the entries that need it back as one batch in cluster order, all of
+ * them or only those holding file data.
+ */
+static bool flush_entries(BufCache *cache, bool data_only) {
+
+    if (cache->direct || (cache->dirty_count == 0 && cache->logged_count == 0))
+        return true;
+
+    uint32_t max = cache->dirty_count + cache->logged_count;
+    uint32_t *order = (uint32_t *) malloc(max * sizeof(uint32_t));
+    IoRequest *reqs = (IoRequest *) malloc(max * sizeof(IoRequest));
+    uint32_t n = 0;
+    bool logged = false;
+    bool data = false;
+
+    if (order && reqs) {
+
+        for (uint32_t i = 0; i < cache->num_entries && n < max; i++) {
+
+            BufEntry *e = &cache->entries[i];
+
+            if (!unwritten(cache, e) || (data_only && e->meta))
+                continue;
+
+            logged = logged || e->logged;
+            data = data || !e->meta;
+            order[n++] = i;
+        }
+    }
+    else {
+
+        free(order);
+        free(reqs);
+
+        //no memory for a batch, write them as they come
+        bool ok = true;
+
+        for (uint32_t i = 0; i < cache->num_entries; i++) {
+            if (!data_only || !cache->entries[i].meta)
+                ok = write_back(cache, i) && ok;
+        }
+
+        return ok;
+    }
+
+    //ascending cluster order keeps the writes moving forward through the image
+    sort_cache = cache;
+    qsort(order, n, sizeof(uint32_t), by_cluster);
+
+    for (uint32_t i = 0; i < n; i++) {
+        reqs[i].offset = cluster_offset(cache, cache->entries[order[i]].cluster);
+        reqs[i].buf = entry_data(cache, order[i]);
+        reqs[i].len = cache->cluster_size;
+        reqs[i].write = true;
+    }
+
+    //logged blocks only go home once their records are durable
+    bool ok = !logged || journal_commit(cache->journal);
+
+    if (ok && data && cache->journal)
+        journal_data_written(cache->journal);
+
+    ok = ok && blockdev_submit(cache->dev, reqs, n);
+
+    //on failure everything stays dirty and the next flush tries again
+    if (ok) {
+        for (uint32_t i = 0; i < n; i++)
+            mark_written(cache, order[i]);
+    }
+
+    free(order);
+    free(reqs);
+
+    return ok;
+}
+
+bool buf_cache_flush(BufCache *cache) {
+
+    return flush_entries(cache, false);
+}
+
+bool buf_cache_flush_data(BufCache *cache) {
+
+    return flush_entries(cache, true);
+}
+
+bool buf_cache_log(BufCache *cache, JournalTxn *txn) {
+
+    for (uint32_t i = 0; i < cache->num_entries; i++) {
+
+        BufEntry *e = &cache->entries[i];
+
+        if (e->meta && e->dirty && !journal_txn_add(txn, cluster_offset(cache, e->cluster), entry_data(cache, i), cache->cluster_size))
+            return false;
+    }
+
+    return true;
+}
+
+void buf_cache_logged(BufCache *cache) {
+
+    for (uint32_t i = 0; i < cache->num_entries; i++) {
+
+        BufEntry *e = &cache->entries[i];
+
+        if (!e->meta || !e->dirty)
+            continue;
+
+        e->dirty = false;
+        cache->dirty_count--;
+
+        if (!e->logged) {
+            e->logged = true;
+            cache->logged_count++;
+        }
+    }
+}
@@ -0,0 +1,135 @@
+#include "chaincache.h"
+#include <stdlib.h>
+#include <string.h>
+
+bool chain_cache_init(ChainCache *cache, uint32_t num_slots) {
+
+    memset(cache, 0, sizeof(*cache));
+
+    if (num_slots == 0)
+        num_slots = CHAIN_CACHE_DEFAULT_SLOTS;
+
+    cache->slots = (ChainCacheSlot *) calloc(num_slots, sizeof(ChainCacheSlot));
+
+    if (!cache->slots)
+        return false;
+
+    cache->num_slots = num_slots;
+
+    for (uint32_t i = 0; i < num_slots; i++)
+        extent_map_init(&cache->slots[i].map);
+
+    return true;
+}
+
+void chain_cache_free(ChainCache *cache) {
+
+    for (uint32_t i = 0; i < cache->num_slots; i++)
+        extent_map_free(&cache->slots[i].map);
+
+    free(cache->slots);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static void drop_slot(ChainCacheSlot *slot) {
+
+    slot->start = 0;
+    extent_map_clear(&slot->map);
+}
+
+const ExtentMap* chain_cache_get(ChainCache *cache, uint32_t start) {
+
+    if (start < 2)
+        return NULL;
+
+    for (uint32_t i = 0; i < cache->num_slots; i++) {
+
+        ChainCacheSlot *slot = &cache->slots[i];
+
+        if (slot->start == start) {
+            slot->last_used = ++cache->clock;
+            return &slot->map;
+        }
+    }
+
+    return NULL;
+}
+
+const ExtentMap* chain_cache_put(ChainCache *cache, uint32_t start, ExtentMap *map) {
+
+    if (start < 2 || cache->num_slots == 0 || map->count == 0)
+        return NULL;
+
+    //same key if present, else an empty slot, else the least recently used
+    ChainCacheSlot *victim = NULL;
+
+    for (uint32_t i = 0; i < cache->num_slots; i++) {
+
+        ChainCacheSlot *slot = &cache->slots[i];
+
+        if (slot->start == start) {
+            victim = slot;
+            break;
+        }
+
+        if (!victim || (victim->start != 0 && (slot->start == 0 || slot->last_used < victim->last_used)))
+            victim = slot;
+    }
+
+    ExtentMap old = victim->map;
+    victim->map = *map;
+    *map = old;
+    extent_map_clear(map);
+
+    victim->start = start;
+    victim->lo = 0xFFFFFFFF;
+    victim->hi = 0;
+
+    for (uint32_t i = 0; i < victim->map.count; i++) {
+
+        const ClusterExtent *run = &victim->map.runs[i];
+
+        if (run->start < victim->lo)
+            victim->lo = run->start;
+        if (run->start + run->length - 1 > victim->hi)
+            victim->hi = run->start + run->length - 1;
+    }
+
+    victim->last_used = ++cache->clock;
+
+    return &victim->map;
+}
+
+void chain_cache_invalidate(ChainCache *cache, uint32_t start) {
+
+    for (uint32_t i = 0; i < cache->num_slots; i++) {
+        if (cache->slots[i].start == start)
+            drop_slot(&cache->slots[i]);
+    }
+}
+
+void chain_cache_invalidate_range(ChainCache *cache, uint32_t first, uint32_t count) {
+
+    if (count == 0)
+        return;
+
+    uint32_t last = first + count - 1;
+
+    for (uint32_t i = 0; i < cache->num_slots; i++) {
+
+        ChainCacheSlot *slot = &cache->slots[i];
+
+        if (slot->start == 0 || slot->hi < first || slot->lo > last)
+            continue;
+
+        for (uint32_t r = 0; r < slot->map.count; r++) {
+
+            const ClusterExtent *run = &slot->map.runs[r];
+
+            if (run->start <= last && run->start + run->length - 1 >= first) {
+                drop_slot(slot);
+                break;
+            }
+        }
+    }
+}
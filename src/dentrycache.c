@@ -0,0 +1,113 @@
+#include "dentrycache.h"
+#include <stdlib.h>
+#include <string.h>
+
+bool dentry_cache_init(DentryCache *cache) {
+
+    memset(cache, 0, sizeof(*cache));
+
+    cache->entries = (Dentry *) calloc((size_t)DENTRY_CACHE_SETS * DENTRY_CACHE_WAYS, sizeof(Dentry));
+
+    return cache->entries != NULL;
+}
+
+void dentry_cache_free(DentryCache *cache) {
+
+    free(cache->entries);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static Dentry* set_of(DentryCache *cache, uint32_t parent, const char name[11]) {
+
+    uint32_t hash = 0x811C9DC5 ^ parent;
+
+    hash *= 0x01000193;
+
+    for (int i = 0; i < 11; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 0x01000193;
+    }
+
+    return &cache->entries[(size_t)(hash % DENTRY_CACHE_SETS) * DENTRY_CACHE_WAYS];
+}
+
+static Dentry* find(Dentry *set, uint32_t parent, const char name[11]) {
+
+    for (int w = 0; w < DENTRY_CACHE_WAYS; w++) {
+        if (set[w].parent == parent && memcmp(set[w].name, name, 11) == 0)
+            return &set[w];
+    }
+
+    return NULL;
+}
+
+const Dentry* dentry_cache_get(DentryCache *cache, uint32_t parent, const char name[11]) {
+
+    if (!cache->entries || parent < 2)
+        return NULL;
+
+    Dentry *d = find(set_of(cache, parent, name), parent, name);
+
+    if (d)
+        d->last_used = ++cache->clock;
+
+    return d;
+}
+
+void dentry_cache_put(DentryCache *cache, const Dentry *d) {
+
+    if (!cache->entries || d->parent < 2)
+        return;
+
+    Dentry *set = set_of(cache, d->parent, d->name);
+    Dentry *victim = find(set, d->parent, d->name);
+
+    //same key if present, else an unused way, else the least recently used
+    for (int w = 0; !victim && w < DENTRY_CACHE_WAYS; w++) {
+        if (set[w].parent == 0)
+            victim = &set[w];
+    }
+
+    if (!victim) {
+
+        victim = &set[0];
+
+        for (int w = 1; w < DENTRY_CACHE_WAYS; w++) {
+            if (set[w].last_used < victim->last_used)
+                victim = &set[w];
+        }
+    }
+
+    if (victim->parent == 0)
+        cache->count++;
+
+    *victim = *d;
+    victim->last_used = ++cache->clock;
+}
+
+void dentry_cache_forget(DentryCache *cache, uint32_t parent, const char name[11]) {
+
+    if (!cache->entries || cache->count == 0)
+        return;
+
+    Dentry *d = find(set_of(cache, parent, name), parent, name);
+
+    if (d) {
+        d->parent = 0;
+        cache->count--;
+    }
+}
+
+void dentry_cache_forget_dir(DentryCache *cache, uint32_t parent) {
+
+    if (!cache->entries || cache->count == 0)
+        return;
+
+    for (size_t i = 0; i < (size_t)DENTRY_CACHE_SETS * DENTRY_CACHE_WAYS; i++) {
+
+        if (cache->entries[i].parent == parent) {
+            cache->entries[i].parent = 0;
+            cache->count--;
+        }
+    }
+}
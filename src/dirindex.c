@@ -0,0 +1,286 @@
+#include "dirindex.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* first table size, doubled whenever it gets half full */
+#define DIR_INDEX_MIN_CAPACITY 64
+
+bool dir_index_init(DirIndex *index, uint32_t num_slots) {
+
+    memset(index, 0, sizeof(*index));
+
+    if (num_slots == 0)
+        num_slots = DIR_INDEX_DEFAULT_SLOTS;
+
+    index->slots = (DirIndexSlot *) calloc(num_slots, sizeof(DirIndexSlot));
+
+    if (!index->slots)
+        return false;
+
+    index->num_slots = num_slots;
+
+    return true;
+}
+
+void dir_index_free(DirIndex *index) {
+
+    for (uint32_t i = 0; i < index->num_slots; i++) {
+        free(index->slots[i].entries);
+        free(index->slots[i].free_slots);
+    }
+
+    free(index->slots);
+    memset(index, 0, sizeof(*index));
+}
+
+static uint32_t name_hash(const char name[11]) {
+
+    uint32_t hash = 0x811C9DC5;
+
+    for (int i = 0; i < 11; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+static void clear_slot(DirIndexSlot *slot) {
+
+    slot->dir = 0;
+    slot->count = 0;
+    slot->tombstones = 0;
+    slot->free_count = 0;
+    slot->has_end = false;
+    slot->tail = 0;
+    slot->num_clusters = 0;
+
+    if (slot->entries)
+        memset(slot->entries, 0, (size_t)slot->capacity * sizeof(DirIndexEntry));
+}
+
+/*
+ * probe()
+ * Where 'name' is, or else the first free position on its probe sequence
+ * (a tombstone if one was passed). The table always has an empty position.
+ */
+static DirIndexEntry* probe(const DirIndexSlot *slot, const char name[11]) {
+
+    uint32_t mask = slot->capacity - 1;
+    uint32_t i = name_hash(name) & mask;
+    DirIndexEntry *reuse = NULL;
+
+    while (1) {
+
+        DirIndexEntry *e = &slot->entries[i];
+
+        if (e->state == DIR_INDEX_EMPTY)
+            return reuse ? reuse : e;
+
+        if (e->state == DIR_INDEX_DELETED) {
+            if (!reuse)
+                reuse = e;
+        }
+        else if (memcmp(e->name, name, 11) == 0) {
+            return e;
+        }
+
+        i = (i + 1) & mask;
+    }
+}
+
+//rehash into a table of 'capacity' positions, dropping the tombstones
+static bool resize(DirIndexSlot *slot, uint32_t capacity) {
+
+    DirIndexEntry *entries = (DirIndexEntry *) calloc(capacity, sizeof(DirIndexEntry));
+
+    if (!entries)
+        return false;
+
+    DirIndexEntry *old = slot->entries;
+    uint32_t old_capacity = slot->capacity;
+
+    slot->entries = entries;
+    slot->capacity = capacity;
+    slot->tombstones = 0;
+
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old[i].state == DIR_INDEX_USED)
+            *probe(slot, old[i].name) = old[i];
+    }
+
+    free(old);
+
+    return true;
+}
+
+DirIndexSlot* dir_index_get(DirIndex *index, uint32_t dir) {
+
+    if (dir < 2)
+        return NULL;
+
+    for (uint32_t i = 0; i < index->num_slots; i++) {
+
+        DirIndexSlot *slot = &index->slots[i];
+
+        if (slot->dir == dir) {
+            slot->last_used = ++index->clock;
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+DirIndexSlot* dir_index_create(DirIndex *index, uint32_t dir) {
+
+    if (dir < 2 || index->num_slots == 0)
+        return NULL;
+
+    //same key if present, else an empty slot, else the least recently used
+    DirIndexSlot *victim = NULL;
+
+    for (uint32_t i = 0; i < index->num_slots; i++) {
+
+        DirIndexSlot *slot = &index->slots[i];
+
+        if (slot->dir == dir) {
+            victim = slot;
+            break;
+        }
+
+        if (!victim || (victim->dir != 0 && (slot->dir == 0 || slot->last_used < victim->last_used)))
+            victim = slot;
+    }
+
+    clear_slot(victim);
+
+    if (!victim->entries && !resize(victim, DIR_INDEX_MIN_CAPACITY))
+        return NULL;
+
+    victim->dir = dir;
+    victim->last_used = ++index->clock;
+
+    return victim;
+}
+
+void dir_index_drop(DirIndex *index, uint32_t dir) {
+
+    for (uint32_t i = 0; i < index->num_slots; i++) {
+        if (index->slots[i].dir == dir)
+            clear_slot(&index->slots[i]);
+    }
+}
+
+bool dir_index_insert(DirIndexSlot *slot, const char name[11], const DirSlot *at, uint8_t attr) {
+
+    //keep at least half the positions empty so probes stay short
+    if ((slot->count + slot->tombstones + 1) * 2 > slot->capacity) {
+
+        uint32_t capacity = slot->capacity;
+
+        while ((slot->count + 1) * 2 > capacity / 2)
+            capacity *= 2;
+
+        if (!resize(slot, capacity))
+            return false;
+    }
+
+    DirIndexEntry *e = probe(slot, name);
+
+    if (e->state != DIR_INDEX_USED) {
+
+        if (e->state == DIR_INDEX_DELETED)
+            slot->tombstones--;
+
+        memcpy(e->name, name, 11);
+        e->state = DIR_INDEX_USED;
+        slot->count++;
+    }
+
+    e->attr = attr;
+    e->at = *at;
+
+    return true;
+}
+
+const DirIndexEntry* dir_index_find(const DirIndexSlot *slot, const char name[11]) {
+
+    const DirIndexEntry *e = probe(slot, name);
+
+    return (e->state == DIR_INDEX_USED) ? e : NULL;
+}
+
+void dir_index_remove(DirIndexSlot *slot, const char name[11]) {
+
+    DirIndexEntry *e = probe(slot, name);
+
+    if (e->state != DIR_INDEX_USED)
+        return;
+
+    e->state = DIR_INDEX_DELETED;
+    slot->count--;
+    slot->tombstones++;
+}
+
+bool dir_index_release_slot(DirIndexSlot *slot, const DirSlot *at) {
+
+    if (slot->free_count == slot->free_capacity) {
+
+        uint32_t capacity = slot->free_capacity ? slot->free_capacity * 2 : 16;
+        DirSlot *grown = (DirSlot *) realloc(slot->free_slots, capacity * sizeof(DirSlot));
+
+        if (!grown)
+            return false;
+
+        slot->free_slots = grown;
+        slot->free_capacity = capacity;
+    }
+
+    //sift up
+    DirSlot *heap = slot->free_slots;
+    uint32_t i = slot->free_count++;
+
+    while (i > 0 && heap[(i - 1) / 2].slot > at->slot) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    heap[i] = *at;
+
+    return true;
+}
+
+bool dir_index_take_slot(DirIndexSlot *slot, DirSlot *out) {
+
+    if (slot->free_count == 0)
+        return false;
+
+    DirSlot *heap = slot->free_slots;
+
+    *out = heap[0];
+
+    //sift the last one down from the top
+    DirSlot last = heap[--slot->free_count];
+    uint32_t n = slot->free_count;
+    uint32_t i = 0;
+
+    while (2 * i + 1 < n) {
+
+        uint32_t child = 2 * i + 1;
+
+        if (child + 1 < n && heap[child + 1].slot < heap[child].slot)
+            child++;
+
+        if (heap[child].slot >= last.slot)
+            break;
+
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    if (n > 0)
+        heap[i] = last;
+
+    return true;
+}
@@ -0,0 +1,113 @@
+#include "extent.h"
+#include <stdlib.h>
+#include <string.h>
+
+void extent_map_init(ExtentMap *map) {
+
+    memset(map, 0, sizeof(*map));
+}
+
+void extent_map_free(ExtentMap *map) {
+
+    free(map->runs);
+    extent_map_init(map);
+}
+
+void extent_map_clear(ExtentMap *map) {
+
+    map->count = 0;
+    map->total_clusters = 0;
+}
+
+void extent_map_truncate(ExtentMap *map, uint32_t clusters) {
+
+    while (map->count > 0 && map->total_clusters > clusters) {
+
+        ClusterExtent *last = &map->runs[map->count - 1];
+        uint32_t excess = map->total_clusters - clusters;
+
+        if (last->length > excess) {
+            last->length -= excess;
+            map->total_clusters = clusters;
+        }
+        else {
+            map->total_clusters -= last->length;
+            map->count--;
+        }
+    }
+}
+
+bool extent_map_append(ExtentMap *map, uint32_t cluster) {
+
+    if (map->count > 0) {
+
+        ClusterExtent *last = &map->runs[map->count - 1];
+
+        if (last->start + last->length == cluster) {
+            last->length++;
+            map->total_clusters++;
+            return true;
+        }
+    }
+
+    if (map->count == map->capacity) {
+
+        uint32_t ncap = (map->capacity == 0) ? 4 : map->capacity * 2;
+        ClusterExtent *tmp = (ClusterExtent *) realloc(map->runs, ncap * sizeof(ClusterExtent));
+
+        if (!tmp)
+            return false;
+
+        map->runs = tmp;
+        map->capacity = ncap;
+    }
+
+    ClusterExtent *run = &map->runs[map->count++];
+
+    run->start = cluster;
+    run->length = 1;
+    run->file_index = map->total_clusters;
+
+    map->total_clusters++;
+
+    return true;
+}
+
+uint32_t extent_map_lookup(const ExtentMap *map, uint32_t index) {
+
+    if (index >= map->total_clusters)
+        return 0;
+
+    //last run whose file_index <= index
+    uint32_t lo = 0;
+    uint32_t hi = map->count - 1;
+
+    while (lo < hi) {
+
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+
+        if (map->runs[mid].file_index <= index)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    const ClusterExtent *run = &map->runs[lo];
+
+    return run->start + (index - run->file_index);
+}
+
+uint32_t extent_map_last(const ExtentMap *map) {
+
+    if (map->count == 0)
+        return 0;
+
+    const ClusterExtent *run = &map->runs[map->count - 1];
+
+    return run->start + run->length - 1;
+}
+
+uint32_t extent_map_first(const ExtentMap *map) {
+
+    return (map->count == 0) ? 0 : map->runs[0].start;
+}
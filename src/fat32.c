@@ -1,5 +1,6 @@
 #define _POSIX_C_SOURCE 200809L //HUGH: strdup support cross-compiler because why????
 #include "fat32.h"
+#include "fatscan.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,24 +23,98 @@ static uint32_t read_le32(const unsigned char *p) {
          | ((uint32_t)p[3] << 24);
 }
 
+static bool build_free_map(FileSystem *fs);
+static bool read_fsinfo(FileSystem *fs, uint32_t *free_count, uint32_t *next_free);
+static void write_fsinfo(FileSystem *fs, uint32_t free_count, uint32_t next_free);
+static uint32_t read_fat_entry(FileSystem *fs, uint32_t cluster);
+static void write_fat_entry(FileSystem *fs, uint32_t cluster, uint32_t value);
+
+#define FAT32_EOC 0x0FFFFFFF
+#define FAT32_CLEAN_SHUTDOWN 0x08000000 // FAT[1] bit, set while the volume is unmounted cleanly
+
+#define FSINFO_LEAD_SIG   0x41615252
+#define FSINFO_STRUCT_SIG 0x61417272
+#define FSINFO_TRAIL_SIG  0xAA550000
+#define FSINFO_UNKNOWN    0xFFFFFFFF
+
+#define PREFETCH_WINDOW   64 // clusters queued per prefetch_chain() call
+#define READAHEAD_MIN     4 // clusters, first readahead window of a sequential stream
+#define READAHEAD_MAX     256 // clusters, the window stops doubling here
+
+void mount_options_default(MountOptions *opts) {
+
+    memset(opts, 0, sizeof(*opts));
+    opts->device = BLOCKDEV_PREAD;
+    opts->async_io = false;
+    opts->journal = false;
+    opts->durability = DURABILITY_PERIODIC;
+    opts->sync_interval = DURABILITY_DEFAULT_INTERVAL;
+}
+
 /* MULTICLUSTER SAFE
-Mount FAT32 filesystem 
+Mount FAT32 filesystem with default options
 */
 bool fs_mount(FileSystem *fs, const char *image_path) {
+
+    MountOptions opts;
+    mount_options_default(&opts);
+
+    return fs_mount_with(fs, image_path, &opts);
+}
+
+/*
+Mount FAT32 filesystem 
+*/
+bool fs_mount_with(FileSystem *fs, const char *image_path, const MountOptions *opts) {
     memset(fs, 0, sizeof(*fs));
 
-    fs->image = fopen(image_path, "r+b");
+    fs->scan_threads = opts->scan_threads;
+    fs->journal.fd = -1;
+    fs->durability = opts->durability;
+    fs->sync_interval = (opts->sync_interval == 0) ? DURABILITY_DEFAULT_INTERVAL : opts->sync_interval;
+    fs->last_sync = time(NULL);
+
+    fs->image = blockdev_open(image_path, opts->device);
     if (!fs->image) {
         fprintf(stderr, "Error: cannot open image file '%s'\n", image_path);
         return false;
     }
 
+    if (opts->device == BLOCKDEV_DIRECT && strcmp(blockdev_name(fs->image), "direct") != 0)
+        fprintf(stderr, "Warning: O_DIRECT is not supported for '%s', using the pread backend\n", image_path);
+
+    //only a nicety, every caller works the same on the synchronous path
+    if (opts->async_io && !blockdev_enable_async(fs->image, IO_ENGINE_DEPTH))
+        fprintf(stderr, "Warning: io_uring is not available for this image, using synchronous I/O\n");
+
     strncpy(fs->image_name, image_path, sizeof(fs->image_name)-1);
 
+    /* A journal left behind holds operations that never reached the image,
+     * they go in before anything is read. This happens with or without
+     * journaling for this mount */
+    char journal_path[sizeof(fs->image_name) + 4];
+    snprintf(journal_path, sizeof(journal_path), "%s.jnl", fs->image_name);
+
+    int replayed = journal_replay(journal_path, fs->image);
+
+    if (replayed < 0) {
+        fprintf(stderr, "Error: cannot replay journal '%s'\n", journal_path);
+        blockdev_close(fs->image);
+        fs->image = NULL;
+        return false;
+    }
+
+    if (replayed > 0)
+        fprintf(stderr, "Journal: replayed %d transaction(s) from '%s'\n", replayed, journal_path);
+
+    if (opts->journal && !journal_open(&fs->journal, journal_path, fs->image))
+        fprintf(stderr, "Warning: cannot open journal '%s', metadata is written in place\n", journal_path);
+
     unsigned char boot[512];
-    if (fread(boot, 1, sizeof(boot), fs->image) != 512) {
+    if (!blockdev_read(fs->image, 0, boot, sizeof(boot))) {
         fprintf(stderr, "Error: cannot read boot sector\n");
-        fclose(fs->image);
+        journal_close(&fs->journal);
+        blockdev_close(fs->image);
         fs->image = NULL;
         return false;
     }
@@ -56,7 +131,9 @@ bool fs_mount(FileSystem *fs, const char *image_path) {
     bpb->total_sectors = (total16 != 0) ? total16 : total32;
 
     bpb->fat_size_sectors = read_le32(&boot[0x24]);
+    bpb->ext_flags = read_le16(&boot[0x28]);
     bpb->root_cluster = boot[0x2C];
+    bpb->fsinfo_sector = read_le16(&boot[0x30]);
 
     uint32_t sectors_per_cluster = bpb->sectors_per_cluster;
 
@@ -74,9 +151,112 @@ bool fs_mount(FileSystem *fs, const char *image_path) {
 
     /* Start with current working directory at the root cluster */
     fs->cwd_cluster = bpb->root_cluster;
+    fs->cwd_path.valid = true;
 
     fs->fat_end_sector = fs->fat_start_sector + bpb->fat_size_sectors;
 
+    /* FAT updates go to every copy unless the BPB says only one FAT is active */
+    long fat_bytes = (long)bpb->fat_size_sectors * bpb->bytes_per_sector;
+    long fat_base = (long)fs->fat_start_sector * bpb->bytes_per_sector;
+    uint32_t fat_copies = bpb->num_fats;
+
+    if (bpb->ext_flags & 0x80) {
+        uint32_t active = bpb->ext_flags & 0x0F;
+
+        if (active < bpb->num_fats)
+            fat_base += (long)active * fat_bytes;
+
+        fat_copies = 1;
+    }
+
+    fat_scan_init();
+
+    if (!fat_cache_init(&fs->fat_cache, bpb->fat_size_sectors, bpb->bytes_per_sector,
+                        fat_base, fat_copies, fat_bytes)) {
+        fprintf(stderr, "Error: cannot allocate FAT cache\n");
+        journal_close(&fs->journal);
+        blockdev_close(fs->image);
+        fs->image = NULL;
+        return false;
+    }
+
+    if (!chain_cache_init(&fs->chain_cache, CHAIN_CACHE_DEFAULT_SLOTS)) {
+        fprintf(stderr, "Error: cannot allocate chain cache\n");
+        fat_cache_free(&fs->fat_cache);
+        journal_close(&fs->journal);
+        blockdev_close(fs->image);
+        fs->image = NULL;
+        return false;
+    }
+
+    if (!dir_index_init(&fs->dir_index, DIR_INDEX_DEFAULT_SLOTS)) {
+        fprintf(stderr, "Error: cannot allocate directory index\n");
+        chain_cache_free(&fs->chain_cache);
+        fat_cache_free(&fs->fat_cache);
+        journal_close(&fs->journal);
+        blockdev_close(fs->image);
+        fs->image = NULL;
+        return false;
+    }
+
+    if (!dentry_cache_init(&fs->dentry_cache)) {
+        fprintf(stderr, "Error: cannot allocate dentry cache\n");
+        dir_index_free(&fs->dir_index);
+        chain_cache_free(&fs->chain_cache);
+        fat_cache_free(&fs->fat_cache);
+        journal_close(&fs->journal);
+        blockdev_close(fs->image);
+        fs->image = NULL;
+        return false;
+    }
+
+    if (!buf_cache_init(&fs->buf_cache, fs->image,
+                        (uint64_t)fs->first_data_sector * bpb->bytes_per_sector,
+                        bpb->bytes_per_sector * sectors_per_cluster, opts->cache_bytes, &fs->journal)) {
+        fprintf(stderr, "Error: cannot allocate buffer cache\n");
+        dentry_cache_free(&fs->dentry_cache);
+        dir_index_free(&fs->dir_index);
+        chain_cache_free(&fs->chain_cache);
+        fat_cache_free(&fs->fat_cache);
+        journal_close(&fs->journal);
+        blockdev_close(fs->image);
+        fs->image = NULL;
+        return false;
+    }
+
+    /* Use the FSInfo free count and hint when the last unmount was clean and
+     * no full scan was asked for, otherwise do a full pass over the FAT */
+    uint32_t fsi_free = FSINFO_UNKNOWN;
+    uint32_t fsi_next = FSINFO_UNKNOWN;
+    bool clean = (read_fat_entry(fs, 1) & FAT32_CLEAN_SHUTDOWN) != 0;
+
+    fs->fsinfo_valid = read_fsinfo(fs, &fsi_free, &fsi_next);
+
+    if (fs->scan_threads == 0 && fs->fsinfo_valid && clean &&
+        fsi_free != FSINFO_UNKNOWN && fsi_free <= fs->total_clusters) {
+        free_map_init_counts(&fs->free_map, fs->total_clusters, fsi_free, fsi_next);
+    }
+    else if (!build_free_map(fs)) {
+        fprintf(stderr, "Error: cannot build free cluster map\n");
+        buf_cache_free(&fs->buf_cache);
+        dentry_cache_free(&fs->dentry_cache);
+        dir_index_free(&fs->dir_index);
+        chain_cache_free(&fs->chain_cache);
+        fat_cache_free(&fs->fat_cache);
+        journal_close(&fs->journal);
+        blockdev_close(fs->image);
+        fs->image = NULL;
+        return false;
+    }
+
+    /* Mark the volume in use until fs_unmount. If we never get there the
+     * next mount sees the dirty bit and the unknown FSInfo values and rescans */
+    if (fs->fsinfo_valid)
+        write_fsinfo(fs, FSINFO_UNKNOWN, FSINFO_UNKNOWN);
+
+    write_fat_entry(fs, 1, read_fat_entry(fs, 1) & ~FAT32_CLEAN_SHUTDOWN);
+    fs_flush(fs);
+
     return true;
 }
 
@@ -85,11 +265,231 @@ Unmount filesystem
 */
 void fs_unmount(FileSystem *fs) {
     if (fs->image) {
-        fclose(fs->image);
+        /* Save the allocator state for the next mount and mark the volume clean */
+        if (fs->fsinfo_valid)
+            write_fsinfo(fs, fs->free_map.free_count, fs->free_map.next_free);
+
+        write_fat_entry(fs, 1, read_fat_entry(fs, 1) | FAT32_CLEAN_SHUTDOWN);
+
+        fs->checkpoint_due = true; //leave an empty journal behind
+        fs_flush(fs);
+        buf_cache_free(&fs->buf_cache);
+        fat_cache_free(&fs->fat_cache);
+        chain_cache_free(&fs->chain_cache);
+        dir_index_free(&fs->dir_index);
+        dentry_cache_free(&fs->dentry_cache);
+        free_map_free(&fs->free_map);
+        free(fs->cwd_path.levels);
+        memset(&fs->cwd_path, 0, sizeof(fs->cwd_path));
+        journal_close(&fs->journal);
+        blockdev_close(fs->image);
         fs->image = NULL;
     }
 }
 
+/*
+ * fs_checkpoint()
+ * Moves everything the journal holds to its home location: the log is made
+ * durable, logged clusters and FAT sectors are written in place, the image
+ * is synced, and only then is the log emptied.
+ */
+static bool fs_checkpoint(FileSystem *fs) {
+
+    bool ok = journal_commit(&fs->journal) &&
+              buf_cache_flush(&fs->buf_cache) &&
+              fat_cache_flush(&fs->fat_cache, fs->image) &&
+              blockdev_sync(fs->image) &&
+              journal_reset(&fs->journal);
+
+    //try again at the next operation
+    fs->checkpoint_due = !ok;
+
+    return ok;
+}
+
+/*
+ * log_metadata()
+ * fs_flush() with a journal. File data is written in place first, then the
+ * dirty FAT sectors and directory clusters become one journal record. The
+ * image is synced before the log is fsynced, so on disk the data is there
+ * before the record. A checkpoint follows when the log is big or one was
+ * asked for.
+ */
+static bool log_metadata(FileSystem *fs) {
+
+    bool ok = buf_cache_flush_data(&fs->buf_cache);
+
+    JournalTxn txn;
+    journal_txn_init(&txn);
+
+    if (ok && fat_cache_log(&fs->fat_cache, &txn) && buf_cache_log(&fs->buf_cache, &txn) &&
+        journal_append(&fs->journal, &txn)) {
+        fat_cache_logged(&fs->fat_cache);
+        buf_cache_logged(&fs->buf_cache);
+    }
+    else {
+        ok = false; //still dirty, the next flush logs it again
+    }
+
+    journal_txn_free(&txn);
+
+    if (ok && (fs->checkpoint_due || journal_full(&fs->journal)))
+        ok = fs_checkpoint(fs);
+
+    return ok;
+}
+
+/*
+ * fs_flush()
+ * Writes dirty clusters and dirty FAT sectors back to the image and hands the
+ * backend's pending writes to the OS. Data goes first so the FAT never points
+ * at clusters whose contents are still only in memory.
+ */
+bool fs_flush(FileSystem *fs) {
+
+    if (!fs || !fs->image)
+        return false;
+
+    if (journal_active(&fs->journal))
+        return log_metadata(fs) && blockdev_flush(fs->image);
+
+    bool ok = buf_cache_flush(&fs->buf_cache);
+
+    if (!fat_cache_flush(&fs->fat_cache, fs->image))
+        ok = false;
+
+    if (!blockdev_flush(fs->image))
+        ok = false;
+
+    return ok;
+}
+
+/*
+ * make_durable()
+ * fsync whatever fs_flush() wrote. With a journal that is the file data
+ * written in place plus the log, the metadata's home locations are synced
+ * at the next checkpoint.
+ */
+static bool make_durable(FileSystem *fs) {
+
+    bool ok = journal_active(&fs->journal) ?
+              journal_sync_data(&fs->journal) && journal_commit(&fs->journal) :
+              blockdev_sync(fs->image);
+
+    if (ok)
+        fs->last_sync = time(NULL);
+
+    return ok;
+}
+
+/*
+ * fs_commit()
+ * Called where an operation ends. Without a journal NONE and CLOSE leave the
+ * changes in the caches, the image then only lags behind memory. With a
+ * journal the operation still becomes its own record so a crash can never
+ * replay half of it.
+ */
+bool fs_commit(FileSystem *fs) {
+
+    if (!fs || !fs->image)
+        return false;
+
+    switch (fs->durability) {
+
+    case DURABILITY_NONE:
+    case DURABILITY_CLOSE:
+        return journal_active(&fs->journal) ? fs_flush(fs) : true;
+
+    case DURABILITY_PERIODIC:
+        if (!fs_flush(fs))
+            return false;
+
+        if (difftime(time(NULL), fs->last_sync) < (double)fs->sync_interval)
+            return true;
+
+        return make_durable(fs);
+
+    case DURABILITY_STRICT:
+        return fs_flush(fs) && make_durable(fs);
+    }
+
+    return false;
+}
+
+bool fs_file_closed(FileSystem *fs) {
+
+    if (!fs || !fs->image)
+        return false;
+
+    return (fs->durability == DURABILITY_CLOSE) ? fs_sync(fs) : true;
+}
+
+/*
+ * fs_sync()
+ * Everything in the caches goes to the image and the image is fsynced. With
+ * a journal that is a full checkpoint, which also empties the log.
+ */
+bool fs_sync(FileSystem *fs) {
+
+    if (!fs || !fs->image)
+        return false;
+
+    if (journal_active(&fs->journal))
+        fs->checkpoint_due = true;
+
+    if (!fs_flush(fs))
+        return false;
+
+    //the checkpoint has synced the image already
+    if (journal_active(&fs->journal)) {
+        fs->last_sync = time(NULL);
+        return true;
+    }
+
+    return make_durable(fs);
+}
+
+bool fs_set_durability(FileSystem *fs, Durability mode, unsigned interval) {
+
+    if (!fs || !fs->image)
+        return false;
+
+    fs->durability = mode;
+
+    if (interval > 0)
+        fs->sync_interval = interval;
+
+    return fs_commit(fs);
+}
+
+bool durability_from_name(const char *name, Durability *mode) {
+
+    if (strcmp(name, "none") == 0)
+        *mode = DURABILITY_NONE;
+    else if (strcmp(name, "close") == 0)
+        *mode = DURABILITY_CLOSE;
+    else if (strcmp(name, "periodic") == 0)
+        *mode = DURABILITY_PERIODIC;
+    else if (strcmp(name, "strict") == 0)
+        *mode = DURABILITY_STRICT;
+    else
+        return false;
+
+    return true;
+}
+
+const char* durability_name(Durability mode) {
+
+    switch (mode) {
+    case DURABILITY_NONE:     return "none";
+    case DURABILITY_CLOSE:    return "close";
+    case DURABILITY_PERIODIC: return "periodic";
+    case DURABILITY_STRICT:   return "strict";
+    }
+
+    return "unknown";
+}
+
 /* MULTICLUSTER SAFE
 info command 
 */
@@ -119,10 +519,22 @@ void cmd_info(const FileSystem *fs) {
     printf("total # of clusters in data region: %u\n", total_clusters);
     printf("# of entries in one FAT: %u\n", entries_per_fat);
     printf("size of image (in bytes): %llu\n", image_bytes);
+    printf("free clusters: %u\n", fs->free_map.free_count);
+    printf("free space (in bytes): %llu\n",
+           (unsigned long long)fs->free_map.free_count * bytes_per_sector * sectors_per_cluster);
 
-}
+    if (fs->fat_stats_valid) {
+        const FatStats *st = &fs->fat_stats;
 
-#define FAT32_EOC 0x0FFFFFFF
+        printf("FAT scan at mount (%u threads):\n", fs->scan_threads);
+        printf("  used clusters: %u\n", st->used_clusters);
+        printf("  cluster chains: %u\n", st->chains);
+        printf("  fragmented links: %u\n", st->fragments);
+        printf("  bad clusters: %u\n", st->bad_clusters);
+        printf("  invalid links: %u\n", st->invalid_links);
+    }
+
+}
 
 /* MULTICLUSTER SAFE
 Convert a cluster number to a byte offset in the image file 
@@ -139,6 +551,81 @@ static long cluster_to_offset(const FileSystem *fs, uint32_t cluster) {
     return (long)sector * bytes_per_sector;
 }
 
+/*
+ * pin_cluster() / unpin_cluster()
+ * Contents of a data cluster for reading, out of the buffer cache. Every
+ * successful pin must be matched by an unpin once the caller is done with
+ * the pointer. NULL on I/O error.
+ */
+static const unsigned char* pin_cluster(FileSystem *fs, uint32_t cluster) {
+
+    return buf_cache_pin(&fs->buf_cache, cluster);
+}
+
+static void unpin_cluster(FileSystem *fs, uint32_t cluster) {
+
+    buf_cache_unpin(&fs->buf_cache, cluster);
+}
+
+/*
+ * image_read() / image_write()
+ * len bytes at an absolute image offset. Inside the data region they go
+ * through the buffer cache, split at cluster boundaries, anywhere else
+ * straight to the device. Only directory entries are written this way, so
+ * the clusters written are metadata to the journal.
+ */
+static bool image_read(FileSystem *fs, uint64_t offset, void *dst, uint32_t len) {
+
+    uint64_t data_start = (uint64_t)fs->first_data_sector * fs->bpb.bytes_per_sector;
+    uint32_t cluster_size = fs->buf_cache.cluster_size;
+    unsigned char *p = (unsigned char *) dst;
+
+    if (offset < data_start)
+        return blockdev_read(fs->image, offset, dst, len);
+
+    while (len > 0) {
+
+        uint32_t cluster = 2 + (uint32_t)((offset - data_start) / cluster_size);
+        uint32_t off = (uint32_t)((offset - data_start) % cluster_size);
+        uint32_t n = (len < cluster_size - off) ? len : cluster_size - off;
+
+        if (!buf_cache_read(&fs->buf_cache, cluster, off, p, n))
+            return false;
+
+        p += n;
+        offset += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool image_write(FileSystem *fs, uint64_t offset, const void *src, uint32_t len) {
+
+    uint64_t data_start = (uint64_t)fs->first_data_sector * fs->bpb.bytes_per_sector;
+    uint32_t cluster_size = fs->buf_cache.cluster_size;
+    const unsigned char *p = (const unsigned char *) src;
+
+    if (offset < data_start)
+        return blockdev_write(fs->image, offset, src, len);
+
+    while (len > 0) {
+
+        uint32_t cluster = 2 + (uint32_t)((offset - data_start) / cluster_size);
+        uint32_t off = (uint32_t)((offset - data_start) % cluster_size);
+        uint32_t n = (len < cluster_size - off) ? len : cluster_size - off;
+
+        if (!buf_cache_write_meta(&fs->buf_cache, cluster, off, p, n))
+            return false;
+
+        p += n;
+        offset += n;
+        len -= n;
+    }
+
+    return true;
+}
+
 
 //MULTICLUSTER SAFE
 static void build_short_name(char dest[11], const char *name) {
@@ -157,183 +644,1274 @@ static void build_short_name(char dest[11], const char *name) {
     }
 }
 
-/* MULTICLUSTER SAFE
-Read a FAT32 entry for a given cluster.
+/*
+ * format_short_name()
+ * "NAME    EXT" as it is shown in paths: "NAME.EXT", or "NAME" without an
+ * extension.
  */
-static uint32_t read_fat_entry(FileSystem *fs, uint32_t cluster) {
+static void format_short_name(char dest[13], const char short_name[11]) {
 
-    const Fat32BootSector *bpb = &fs->bpb;
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = fs->fat_start_sector + (fat_offset / bpb->bytes_per_sector);
-    uint32_t ent_offset = fat_offset % bpb->bytes_per_sector;
+    char name_part[9];
+    char ext_part[4];
+    memcpy(name_part, short_name, 8);
+    name_part[8] = '\0';
+    memcpy(ext_part, short_name + 8, 3);
+    ext_part[3] = '\0';
 
-    long byte_offset = (long)fat_sector * bpb->bytes_per_sector + ent_offset;
-    if (fseek(fs->image, byte_offset, SEEK_SET) != 0) {
-        return FAT32_EOC;
+    for (int i = 7; i >= 0; --i) {
+        if (name_part[i] == ' ') name_part[i] = '\0'; else break;
     }
-
-    unsigned char buf[4];
-    if (fread(buf, 1, 4, fs->image) != 4) {
-        return FAT32_EOC;
+    for (int i = 2; i >= 0; --i) {
+        if (ext_part[i] == ' ') ext_part[i] = '\0'; else break;
     }
 
-    return (uint32_t)buf[0]
-         | ((uint32_t)buf[1] << 8)
-         | ((uint32_t)buf[2] << 16)
-         | ((uint32_t)buf[3] << 24);
+    if (ext_part[0] != '\0') {
+        snprintf(dest, 13, "%s.%s", name_part, ext_part);
+    } else {
+        snprintf(dest, 13, "%s", name_part);
+    }
 }
 
 /* MULTICLUSTER SAFE
-Write FAT32 entry for a given cluster 
-*/
-static void write_fat_entry(FileSystem *fs, uint32_t cluster, uint32_t value) {
+Read a FAT32 entry for a given cluster (served from the FAT cache).
+ */
+static uint32_t read_fat_entry(FileSystem *fs, uint32_t cluster) {
 
-    const Fat32BootSector *bpb = &fs->bpb;
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = fs->fat_start_sector + (fat_offset / bpb->bytes_per_sector);
-    uint32_t ent_offset = fat_offset % bpb->bytes_per_sector;
+    uint32_t value;
 
-    long byte_offset = (long)fat_sector * bpb->bytes_per_sector + ent_offset;
-    if (fseek(fs->image, byte_offset, SEEK_SET) != 0) {
-        return;
+    if (!fat_cache_read(&fs->fat_cache, fs->image, cluster, &value)) {
+        return FAT32_EOC;
     }
 
-    unsigned char buf[4];
-    buf[0] = (unsigned char)(value & 0xFF);
-    buf[1] = (unsigned char)((value >> 8) & 0xFF);
-    buf[2] = (unsigned char)((value >> 16) & 0xFF);
-    buf[3] = (unsigned char)((value >> 24) & 0xFF);
-
-    fwrite(buf, 1, 4, fs->image);
+    return value;
 }
 
-/* MULTICLUSTER SAFE
-Find a free cluster by scanning the FAT 
+/*
+Write FAT32 entry for a given cluster. Only the cached sector is updated,
+it reaches the image on the next fs_flush(). Any cached chain running through
+the cluster no longer matches the FAT and is dropped.
 */
-static uint32_t allocate_cluster(FileSystem *fs) {
-    for (uint32_t c = 2; c < fs->total_clusters + 2; c++) {
-        uint32_t val = read_fat_entry(fs, c);
-        if (val == 0x00000000) {
-            write_fat_entry(fs, c, FAT32_EOC);
-            return c;
-        }
-    }
-    return 0; /* No free cluster */
+static void write_fat_entry(FileSystem *fs, uint32_t cluster, uint32_t value) {
+
+    fat_cache_write(&fs->fat_cache, fs->image, cluster, value);
+    chain_cache_invalidate_range(&fs->chain_cache, cluster, 1);
 }
 
-/* MULTICLUSTER SAFE
-Initialize a newly allocated directory cluster with "." and ".." entries 
-*/
-static void init_directory_cluster(FileSystem *fs,
-                                   uint32_t new_cluster,
-                                   uint32_t parent_cluster) {
-    const Fat32BootSector *bpb = &fs->bpb;
-    uint32_t cluster_size =
-        bpb->bytes_per_sector * bpb->sectors_per_cluster;
+/*
+ * scan_fat_for_free()
+ * Used while the free map has no bitmap (counts came from FSInfo): looks for a
+ * free FAT entry from 'start' to the end of the FAT. Only the FAT sectors
+ * around the cursor get loaded. Returns 0 if nothing is free past 'start'.
+ */
+static uint32_t scan_fat_for_free(FileSystem *fs, uint32_t start) {
 
-    unsigned char *buf = (unsigned char *)calloc(1, cluster_size);
-    if (!buf) return;
+    FatCache *cache = &fs->fat_cache;
+    uint32_t per_sector = cache->sector_size / 4;
+    uint64_t fat_entries = (uint64_t)cache->num_sectors * per_sector;
+    uint32_t end = fs->total_clusters + 2;
 
-    /* "." entry (self) */
-    unsigned char *dot = buf;
-    memset(dot, ' ', 11);
-    dot[0] = '.';
-    dot[11] = 0x10; 
+    if (end > fat_entries)
+        end = (uint32_t)fat_entries;
 
-    /* Cluster number for "." (little-endian) */
-    uint32_t cl = new_cluster;
-    dot[20] = (unsigned char)((cl >> 16) & 0xFF);
-    dot[21] = (unsigned char)((cl >> 24) & 0xFF);
-    dot[26] = (unsigned char)(cl & 0xFF);
-    dot[27] = (unsigned char)((cl >> 8) & 0xFF);
+    uint32_t c = start;
 
-    /* ".." entry (parent) */
-    unsigned char *dotdot = buf + 32;
-    memset(dotdot, ' ', 11);
-    dotdot[0] = '.';
-    dotdot[1] = '.';
-    dotdot[11] = 0x10; 
+    //one cache chunk at a time, each handed to the vectorized scan
+    while (c < end) {
 
-    cl = parent_cluster;
-    dotdot[20] = (unsigned char)((cl >> 16) & 0xFF);
-    dotdot[21] = (unsigned char)((cl >> 24) & 0xFF);
-    dotdot[26] = (unsigned char)(cl & 0xFF);
-    dotdot[27] = (unsigned char)((cl >> 8) & 0xFF);
+        uint32_t sector = c / per_sector;
+        uint32_t n = cache->num_sectors - sector;
 
-    long offset = cluster_to_offset(fs, new_cluster);
-    if (fseek(fs->image, offset, SEEK_SET) == 0) {
-        fwrite(buf, 1, cluster_size, fs->image);
-    }
+        if (n > FAT_CACHE_READAHEAD)
+            n = FAT_CACHE_READAHEAD;
 
-    free(buf);
-}
+        const unsigned char *p = fat_cache_sectors(cache, fs->image, sector, n);
 
-//checks free allocation in cluster 
-//NOT MULTICLUSTER SAFE
-static int dir_scan_for_entry(FileSystem *fs,
-                              uint32_t dir_cluster,
-                              const char short_name[11],
-                              long *out_free_offset,
-                              int *out_exists) {
-    const Fat32BootSector *bpb = &fs->bpb;
-    uint32_t cluster_size =
-        bpb->bytes_per_sector * bpb->sectors_per_cluster;
+        if (!p)
+            return 0;
 
-    unsigned char *buf = (unsigned char *)malloc(cluster_size);
-    if (!buf) return -1;
+        uint32_t chunk_end = (sector + n) * per_sector;
 
-    long dir_offset = cluster_to_offset(fs, dir_cluster);
-    if (fseek(fs->image, dir_offset, SEEK_SET) != 0) {
-        free(buf);
-        return -1;
-    }
+        if (chunk_end > end)
+            chunk_end = end;
 
-    if (fread(buf, 1, cluster_size, fs->image) != cluster_size) {
-        free(buf);
-        return -1;
+        uint32_t skip = c - sector * per_sector;
+        uint32_t idx = fat_scan_first_free(p + (size_t)skip * 4, chunk_end - c);
+
+        if (idx < chunk_end - c)
+            return c + idx;
+
+        c = chunk_end;
     }
 
-    *out_free_offset = -1;
-    *out_exists = 0;
+    return 0;
+}
 
-    for (uint32_t off = 0; off < cluster_size; off += 32) {
-        unsigned char *entry = buf + off;
+/*
+ * find_free_cluster()
+ * First free cluster at or after 'start', wrapping around once. Uses the
+ * bitmap when it exists, otherwise probes the FAT from 'start' and builds the
+ * bitmap if that probe runs off the end. Returns 0 if the volume is full.
+ */
+static uint32_t find_free_cluster(FileSystem *fs, uint32_t start) {
 
-        /* 0x00 means this and all following entries are free */
-        if (entry[0] == 0x00) {
-            if (*out_free_offset == -1) {
-                *out_free_offset = dir_offset + (long)off;
-            }
-            break;
-        }
+    FreeMap *map = &fs->free_map;
 
-        /* 0xE5 means deleted */
-        if (entry[0] == 0xE5) {
-            if (*out_free_offset == -1) {
-                *out_free_offset = dir_offset + (long)off;
-            }
-            continue;
+    if (map->bits)
+        return free_map_find(map, start);
+
+    uint32_t c = scan_fat_for_free(fs, start);
+
+    //cursor ran off the end, do the full pass once and use the bitmap from now on
+    if (c == 0 && build_free_map(fs))
+        c = free_map_find(map, start);
+
+    return c;
+}
+
+static bool cluster_is_free(FileSystem *fs, uint32_t cluster) {
+
+    if (fs->free_map.bits)
+        return free_map_is_free(&fs->free_map, cluster);
+
+    if (cluster < 2 || cluster >= fs->total_clusters + 2)
+        return false;
+
+    return (read_fat_entry(fs, cluster) & 0x0FFFFFFF) == 0;
+}
+
+/*
+ * commit_frees()
+ * With a journal, clusters freed by rm or rmdir are only free for good once
+ * the record freeing them is fsynced: a crash before that replays the old
+ * chain, and a new owner's data written in place meanwhile would end up in
+ * the restored file. So the log is committed before anything is allocated
+ * after a free. False if that commit fails, nothing may be allocated then.
+ */
+static bool commit_frees(FileSystem *fs) {
+
+    if (!fs->frees_uncommitted)
+        return true;
+
+    if (!journal_commit(&fs->journal))
+        return false;
+
+    fs->frees_uncommitted = false;
+
+    return true;
+}
+
+/* MULTICLUSTER SAFE
+Take the next free cluster after the rotating cursor and mark it end-of-chain.
+Returns 0 if the volume is full.
+*/
+static uint32_t allocate_cluster(FileSystem *fs) {
+
+    FreeMap *map = &fs->free_map;
+
+    if (!commit_frees(fs))
+        return 0;
+
+    uint32_t c = find_free_cluster(fs, map->next_free);
+
+    if (c == 0)
+        return 0; /* No free cluster */
+
+    write_fat_entry(fs, c, FAT32_EOC);
+    free_map_set_used(map, c);
+    map->next_free = c + 1;
+
+    return c;
+}
+
+/*
+ * find_free_run()
+ * Looks for 'want' consecutive free clusters starting the search at 'start'.
+ * Returns the first run that is long enough, or the longest run seen if there
+ * is none, with its usable length (capped at want) in *run_len. 0 if full.
+ */
+static uint32_t find_free_run(FileSystem *fs, uint32_t start, uint32_t want, uint32_t *run_len) {
+
+    uint32_t end = fs->total_clusters + 2;
+    uint32_t best = 0;
+    uint32_t best_len = 0;
+    uint32_t seen = 0;
+    uint32_t pos = start;
+
+    //every free cluster is looked at most once
+    while (seen < fs->free_map.free_count) {
+
+        uint32_t c = find_free_cluster(fs, pos);
+
+        if (c == 0)
+            break;
+
+        uint32_t len = 1;
+
+        while (len < want && c + len < end && cluster_is_free(fs, c + len))
+            len++;
+
+        if (len > best_len) {
+            best = c;
+            best_len = len;
+        }
+
+        if (len >= want)
+            break;
+
+        seen += len;
+        pos = (c + len < end) ? c + len : 2;
+    }
+
+    *run_len = best_len;
+    return best;
+}
+
+/*
+ * claim_cluster()
+ * Records 'cluster' in 'out', marks it used as the new end of a chain and
+ * links it after 'prev' (unless prev is 0). Returns false on OOM, nothing
+ * is claimed then.
+ */
+static bool claim_cluster(FileSystem *fs, uint32_t prev, uint32_t cluster, ExtentMap *out) {
+
+    //first, so a cluster in the FAT is never missing from the map
+    if (!extent_map_append(out, cluster))
+        return false;
+
+    write_fat_entry(fs, cluster, FAT32_EOC);
+
+    if (prev >= 2)
+        write_fat_entry(fs, prev, cluster);
+
+    free_map_set_used(&fs->free_map, cluster);
+
+    return true;
+}
+
+/*
+ * collect_free_runs()
+ * Every run of free clusters, in the order a search from 'start' meets them
+ * (wrapping around once), appended to 'runs'. One pass over the free space.
+ * False on OOM.
+ */
+static bool collect_free_runs(FileSystem *fs, uint32_t start, ExtentMap *runs) {
+
+    uint32_t end = fs->total_clusters + 2;
+
+    if (start < 2 || start >= end)
+        start = 2;
+
+    uint32_t seen = 0;
+    uint32_t pos = start;
+    bool wrapped = false;
+
+    while (seen < fs->free_map.free_count) {
+
+        uint32_t c = find_free_cluster(fs, pos);
+
+        if (c == 0)
+            break;
+
+        if (c < pos)
+            wrapped = true;
+
+        //back where the search began
+        if (wrapped && c >= start)
+            break;
+
+        uint32_t stop = wrapped ? start : end;
+        uint32_t len = 1;
+
+        while (c + len < stop && cluster_is_free(fs, c + len))
+            len++;
+
+        for (uint32_t i = 0; i < len; i++) {
+            if (!extent_map_append(runs, c + i))
+                return false;
+        }
+
+        seen += len;
+
+        if (c + len < end) {
+            pos = c + len;
+        }
+        else {
+            pos = 2;
+            wrapped = true;
+        }
+    }
+
+    return true;
+}
+
+static const ExtentMap *sort_runs;
+
+//longest first, in search order among equals
+static int by_length(const void *a, const void *b) {
+
+    uint32_t ia = *(const uint32_t *)a;
+    uint32_t ib = *(const uint32_t *)b;
+    uint32_t la = sort_runs->runs[ia].length;
+    uint32_t lb = sort_runs->runs[ib].length;
+
+    if (la != lb)
+        return (la < lb) - (la > lb);
+
+    return (ia > ib) - (ia < ib);
+}
+
+/*
+ * claim_free_runs()
+ * allocate_clusters() when no single free run holds all 'want' clusters.
+ * The runs are gathered in one pass and claimed longest first onto the chain
+ * ending at *last; the last piece comes from the first run in search order
+ * that fits it. Updates *last and *got. False on OOM.
+ */
+static bool claim_free_runs(FileSystem *fs, uint32_t start, uint32_t want,
+                            uint32_t *last, uint32_t *got, ExtentMap *out) {
+
+    ExtentMap runs;
+    extent_map_init(&runs);
+
+    uint32_t *order = NULL;
+    bool ok = collect_free_runs(fs, start, &runs) &&
+              (order = (uint32_t *) malloc((runs.count + 1) * sizeof(uint32_t))) != NULL;
+
+    if (ok) {
+
+        for (uint32_t i = 0; i < runs.count; i++)
+            order[i] = i;
+
+        sort_runs = &runs;
+        qsort(order, runs.count, sizeof(uint32_t), by_length);
+    }
+
+    for (uint32_t k = 0; ok && want > 0 && k < runs.count; k++) {
+
+        ClusterExtent *run = &runs.runs[order[k]];
+
+        if (run->length >= want) {
+
+            //ends in the first run that fits, taken runs are empty by now
+            for (uint32_t j = 0; j < runs.count; j++) {
+                if (runs.runs[j].length >= want) {
+                    run = &runs.runs[j];
+                    break;
+                }
+            }
+        }
+
+        uint32_t take = (run->length < want) ? run->length : want;
+
+        for (uint32_t i = 0; i < take; i++) {
+
+            if (!claim_cluster(fs, *last, run->start + i, out)) {
+                ok = false;
+                break;
+            }
+
+            *last = run->start + i;
+            (*got)++;
+            want--;
+        }
+
+        run->length = 0;
+    }
+
+    free(order);
+    extent_map_free(&runs);
+
+    return ok;
+}
+
+/*
+ * allocate_clusters()
+ * Allocates 'count' clusters as a chain hanging off 'prev' (0 starts a new
+ * chain), as contiguously as possible: first the clusters right after prev,
+ * then the first free run long enough for the rest, falling back to the
+ * longest runs available. The new clusters are appended to 'out', so the
+ * caller gets them back as extents. Returns count, or 0 if the volume could
+ * not supply them or 'out' could not grow (nothing stays allocated in that
+ * case).
+ */
+static uint32_t allocate_clusters(FileSystem *fs, uint32_t prev, uint32_t count, ExtentMap *out) {
+
+    FreeMap *map = &fs->free_map;
+
+    if (count == 0 || map->free_count < count || !commit_frees(fs))
+        return 0;
+
+    uint32_t end = fs->total_clusters + 2;
+    uint32_t base = out->total_clusters;
+    uint32_t last = prev;
+    uint32_t got = 0;
+    bool oom = false;
+
+    //grow in place while the clusters after prev are free
+    if (prev >= 2) {
+
+        for (uint32_t c = prev + 1; got < count && c < end && cluster_is_free(fs, c); c++) {
+
+            if (!claim_cluster(fs, last, c, out)) {
+                oom = true;
+                break;
+            }
+
+            last = c;
+            got++;
+        }
+    }
+
+    if (got < count && !oom) {
+
+        uint32_t len = 0;
+        uint32_t start = find_free_run(fs, map->next_free, count - got, &len);
+
+        //one run takes the rest, the usual case
+        if (start != 0 && len >= count - got) {
+
+            for (uint32_t i = 0; i < len && got < count; i++) {
+
+                if (!claim_cluster(fs, last, start + i, out)) {
+                    oom = true;
+                    break;
+                }
+
+                last = start + i;
+                got++;
+            }
+        }
+        else if (start != 0) {
+            oom = !claim_free_runs(fs, map->next_free, count - got, &last, &got, out);
+        }
+    }
+
+    if (got < count) {
+
+        //give back what we took and end the old chain where it was
+        for (uint32_t i = base; i < out->total_clusters; i++) {
+            uint32_t c = extent_map_lookup(out, i);
+            write_fat_entry(fs, c, 0x00000000);
+            free_map_set_free(map, c);
+        }
+
+        extent_map_truncate(out, base);
+
+        if (prev >= 2)
+            write_fat_entry(fs, prev, FAT32_EOC);
+
+        return 0;
+    }
+
+    map->next_free = last + 1;
+
+    return count;
+}
+
+/*
+ * build_extent_map()
+ * Walks the chain starting at start_cluster once and records it as runs of
+ * consecutive clusters. Returns false on OOM or a chain longer than the volume.
+ */
+static bool build_extent_map(FileSystem *fs, uint32_t start_cluster, ExtentMap *map) {
+
+    extent_map_clear(map);
+
+    uint32_t cluster = start_cluster;
+
+    while (cluster >= 2 && cluster < 0x0FFFFFF8) {
+
+        if (!extent_map_append(map, cluster))
+            return false;
+
+        if (map->total_clusters > fs->total_clusters) //looped chain
+            return false;
+
+        cluster = read_fat_entry(fs, cluster);
+    }
+
+    return true;
+}
+
+/*
+ * chain_extents()
+ * Resolved chain at start_cluster, from the chain cache when it is there,
+ * otherwise walked once and cached. The map is owned by the cache: it is only
+ * good until the FAT is next written. NULL on OOM or a looped chain.
+ */
+static const ExtentMap* chain_extents(FileSystem *fs, uint32_t start_cluster) {
+
+    const ExtentMap *cached = chain_cache_get(&fs->chain_cache, start_cluster);
+
+    if (cached)
+        return cached;
+
+    ExtentMap map;
+    extent_map_init(&map);
+
+    if (!build_extent_map(fs, start_cluster, &map) || map.count == 0) {
+        extent_map_free(&map);
+        return NULL;
+    }
+
+    cached = chain_cache_put(&fs->chain_cache, start_cluster, &map);
+
+    extent_map_free(&map);
+
+    return cached;
+}
+
+/*
+ * file_extents()
+ * Returns the extent map to use for the chain at start_cluster: the open
+ * file's map when there is one (rebuilt only if it describes another chain),
+ * otherwise the chain cache's copy. NULL on failure.
+ */
+static const ExtentMap* file_extents(FileSystem *fs, OpenFile *file, uint32_t start_cluster) {
+
+    if (!file)
+        return chain_extents(fs, start_cluster);
+
+    ExtentMap *map = &file->extents;
+
+    if (map->count > 0 && extent_map_first(map) == start_cluster)
+        return map;
+
+    if (!build_extent_map(fs, start_cluster, map))
+        return NULL;
+
+    return map;
+}
+
+/*
+ * chain_next()
+ * Cluster after 'cur', which is cluster *index of 'chain'. Comes from the
+ * resolved chain when there is one, from the FAT otherwise. 0 past the end.
+ */
+static uint32_t chain_next(FileSystem *fs, const ExtentMap *chain, uint32_t *index, uint32_t cur) {
+
+    (*index)++;
+
+    if (chain)
+        return extent_map_lookup(chain, *index);
+
+    uint32_t next = read_fat_entry(fs, cur);
+
+    return (next >= 2 && next < 0x0FFFFFF8) ? next : 0;
+}
+
+/*
+ * prefetch_chain()
+ * Loads clusters [first_index, first_index + count) of a chain into the
+ * buffer cache as one batch of reads. Each run of consecutive clusters is a
+ * single vectored read, and an asynchronous device has them all in flight
+ * together.
+ */
+static void prefetch_chain(FileSystem *fs, const ExtentMap *chain, uint32_t first_index, uint32_t count) {
+
+    if (!chain || first_index >= chain->total_clusters)
+        return;
+
+    if (count > chain->total_clusters - first_index)
+        count = chain->total_clusters - first_index;
+
+    //a single cluster gains nothing over the demand read
+    if (count < 2)
+        return;
+
+    if (count > PREFETCH_WINDOW)
+        count = PREFETCH_WINDOW;
+
+    uint32_t clusters[PREFETCH_WINDOW];
+
+    for (uint32_t i = 0; i < count; i++)
+        clusters[i] = extent_map_lookup(chain, first_index + i);
+
+    buf_cache_prefetch(&fs->buf_cache, clusters, count);
+}
+
+/* MULTICLUSTER SAFE
+ * prefetch_directory()
+ * Scans often stop in the first cluster of a directory, so the rest of its
+ * chain is only loaded up front when the device reads it all in parallel.
+ */
+static void prefetch_directory(FileSystem *fs, const ExtentMap *dir_chain) {
+
+    if (blockdev_is_async(fs->image))
+        prefetch_chain(fs, dir_chain, 0, PREFETCH_WINDOW);
+}
+
+/*
+ * readahead_chain()
+ * Starts loading clusters [first_index, first_index + count) of a chain
+ * without waiting for them: one OS cache hint per run of consecutive
+ * clusters. Backends with no OS cache in between get a prefetch batch into
+ * the buffer cache instead, if their device is asynchronous.
+ */
+static void readahead_chain(FileSystem *fs, const ExtentMap *chain, uint32_t first_index, uint32_t count) {
+
+    if (!chain || first_index >= chain->total_clusters)
+        return;
+
+    if (count > chain->total_clusters - first_index)
+        count = chain->total_clusters - first_index;
+
+    uint32_t cluster_size = fs->bpb.bytes_per_sector * fs->bpb.sectors_per_cluster;
+    uint32_t i = 0;
+
+    while (i < count) {
+
+        uint32_t start = extent_map_lookup(chain, first_index + i);
+        uint32_t run = 1;
+
+        while (i + run < count && extent_map_lookup(chain, first_index + i + run) == start + run)
+            run++;
+
+        if (!blockdev_readahead(fs->image, (uint64_t)cluster_to_offset(fs, start), (size_t)run * cluster_size)) {
+
+            //loading synchronously here would make the current read wait for the next one
+            if (blockdev_is_async(fs->image))
+                prefetch_chain(fs, chain, first_index + i, count - i);
+            return;
+        }
+
+        i += run;
+    }
+}
+
+/*
+ * file_readahead()
+ * Access pattern detector of an open file, run after each read of 'len'
+ * bytes at 'offset'. A read that starts where the previous one ended is
+ * sequential and doubles the window (READAHEAD_MIN up to READAHEAD_MAX
+ * clusters), anything else resets it. While sequential, readahead is kept a
+ * window ahead of the read position and topped up once less than half of
+ * it is left.
+ */
+static void file_readahead(FileSystem *fs, OpenFile *file, const ExtentMap *chain, uint32_t offset, uint32_t len) {
+
+    uint32_t cluster_size = fs->bpb.bytes_per_sector * fs->bpb.sectors_per_cluster;
+
+    //first cluster the next sequential read still has to load
+    uint32_t next_index = (uint32_t)(((uint64_t)offset + len + cluster_size - 1) / cluster_size);
+
+    if (offset != file->raNext) {
+        file->raNext = offset + len;
+        file->raWindow = 0;
+        file->raEnd = 0;
+        return;
+    }
+
+    file->raNext = offset + len;
+
+    if (file->raWindow == 0)
+        file->raWindow = READAHEAD_MIN;
+    else if (file->raWindow < READAHEAD_MAX)
+        file->raWindow *= 2;
+
+    if (file->raEnd < next_index)
+        file->raEnd = next_index;
+
+    if (file->raEnd - next_index >= file->raWindow / 2)
+        return;
+
+    uint32_t target = next_index + file->raWindow;
+
+    readahead_chain(fs, chain, file->raEnd, target - file->raEnd);
+    file->raEnd = target;
+}
+
+/*
+ * build_free_map()
+ * Fills the free map from the FAT. Every entry is looked at once, which the
+ * FAT cache turns into a sequential read of the whole table. The allocation
+ * cursor survives a rebuild.
+ */
+static bool build_free_map(FileSystem *fs) {
+
+    uint32_t next_free = fs->free_map.next_free;
+    FreeMap *map = &fs->free_map;
+
+    free_map_free(map);
+
+    if (!free_map_init(map, fs->total_clusters))
+        return false;
+
+    if (next_free >= 2)
+        map->next_free = next_free;
+
+    FatCache *cache = &fs->fat_cache;
+    uint32_t per_sector = cache->sector_size / 4;
+    uint64_t fat_entries = (uint64_t)cache->num_sectors * per_sector;
+    uint32_t end = map->num_bits;
+
+    if (end > fat_entries)
+        end = (uint32_t)fat_entries;
+
+    uint32_t fat_sectors = (end + per_sector - 1) / per_sector;
+
+    /* Normal case: pull the FAT in with sequential reads, then scan it from
+     * memory, split across scan_threads workers when asked for */
+    const unsigned char *fat = fat_cache_sectors(cache, fs->image, 0, fat_sectors);
+
+    if (fat) {
+        unsigned threads = (fs->scan_threads > 0) ? fs->scan_threads : 1;
+        FatStats *stats = (fs->scan_threads > 0) ? &fs->fat_stats : NULL;
+
+        fat_stats_scan(fat, end, map->bits, stats, threads);
+
+        fs->fat_stats_valid = (stats != NULL);
+    }
+
+    /* Part of the FAT is unreadable: go chunk by chunk. A chunk starts on a
+     * sector boundary, which is always a multiple of 64 entries */
+    for (uint32_t sector = 0; !fat && (uint64_t)sector * per_sector < end; sector += FAT_CACHE_READAHEAD) {
+
+        uint32_t n = cache->num_sectors - sector;
+
+        if (n > FAT_CACHE_READAHEAD)
+            n = FAT_CACHE_READAHEAD;
+
+        uint32_t first = sector * per_sector;
+        uint32_t count = n * per_sector;
+
+        if (first + count > end)
+            count = end - first;
+
+        const unsigned char *p = fat_cache_sectors(cache, fs->image, sector, n);
+
+        if (!p) {
+            //unreadable part of the FAT, never hand those clusters out
+            for (uint32_t c = first; c < first + count; c++)
+                free_map_set_used(map, c);
+            continue;
+        }
+
+        fat_scan_used_bits(p, count, &map->bits[first / 64]);
+    }
+
+    //clusters the FAT has no entry for cannot be allocated either
+    for (uint32_t c = end; c < map->num_bits; c++)
+        map->bits[c / 64] |= 1ULL << (c % 64);
+
+    free_map_recount(map);
+
+    return true;
+}
+
+/*
+ * read_fsinfo()
+ * Reads the free cluster count and next free hint from the FSInfo sector.
+ * Returns false if the BPB has no FSInfo sector or its signatures are wrong.
+ */
+static bool read_fsinfo(FileSystem *fs, uint32_t *free_count, uint32_t *next_free) {
+
+    uint16_t sector = fs->bpb.fsinfo_sector;
+
+    if (sector == 0 || sector == 0xFFFF || sector >= fs->bpb.reserved_sector_count)
+        return false;
+
+    unsigned char buf[512];
+    long offset = (long)sector * fs->bpb.bytes_per_sector;
+
+    if (!blockdev_read(fs->image, offset, buf, sizeof(buf))) {
+        return false;
+    }
+
+    if (read_le32(&buf[0]) != FSINFO_LEAD_SIG ||
+        read_le32(&buf[484]) != FSINFO_STRUCT_SIG ||
+        read_le32(&buf[508]) != FSINFO_TRAIL_SIG) {
+        return false;
+    }
+
+    *free_count = read_le32(&buf[488]);
+    *next_free = read_le32(&buf[492]);
+
+    return true;
+}
+
+/*
+ * write_fsinfo()
+ * Stores the free cluster count and next free hint in the FSInfo sector.
+ * Only the two fields are written, the signatures were checked at mount.
+ */
+static void write_fsinfo(FileSystem *fs, uint32_t free_count, uint32_t next_free) {
+
+    unsigned char buf[8];
+
+    for (int i = 0; i < 4; i++) {
+        buf[i] = (unsigned char)((free_count >> (8 * i)) & 0xFF);
+        buf[4 + i] = (unsigned char)((next_free >> (8 * i)) & 0xFF);
+    }
+
+    long offset = (long)fs->bpb.fsinfo_sector * fs->bpb.bytes_per_sector + 488;
+
+    blockdev_write(fs->image, offset, buf, sizeof(buf));
+}
+
+/* MULTICLUSTER SAFE
+Initialize a newly allocated directory cluster with "." and ".." entries 
+*/
+static void init_directory_cluster(FileSystem *fs,
+                                   uint32_t new_cluster,
+                                   uint32_t parent_cluster) {
+    const Fat32BootSector *bpb = &fs->bpb;
+    uint32_t cluster_size =
+        bpb->bytes_per_sector * bpb->sectors_per_cluster;
+
+    unsigned char *buf = (unsigned char *)calloc(1, cluster_size);
+    if (!buf) return;
+
+    /* "." entry (self) */
+    unsigned char *dot = buf;
+    memset(dot, ' ', 11);
+    dot[0] = '.';
+    dot[11] = 0x10; 
+
+    /* Cluster number for "." (little-endian) */
+    uint32_t cl = new_cluster;
+    dot[20] = (unsigned char)((cl >> 16) & 0xFF);
+    dot[21] = (unsigned char)((cl >> 24) & 0xFF);
+    dot[26] = (unsigned char)(cl & 0xFF);
+    dot[27] = (unsigned char)((cl >> 8) & 0xFF);
+
+    /* ".." entry (parent) */
+    unsigned char *dotdot = buf + 32;
+    memset(dotdot, ' ', 11);
+    dotdot[0] = '.';
+    dotdot[1] = '.';
+    dotdot[11] = 0x10; 
+
+    cl = parent_cluster;
+    dotdot[20] = (unsigned char)((cl >> 16) & 0xFF);
+    dotdot[21] = (unsigned char)((cl >> 24) & 0xFF);
+    dotdot[26] = (unsigned char)(cl & 0xFF);
+    dotdot[27] = (unsigned char)((cl >> 8) & 0xFF);
+
+    //whole cluster, so the cache does not read the old contents first
+    buf_cache_write_meta(&fs->buf_cache, new_cluster, 0, buf, cluster_size);
+
+    free(buf);
+}
+
+/*
+ * clear_directory_cluster()
+ * Zeroes a cluster just appended to a directory, so every slot in it reads
+ * as free and the end marker follows the last entry.
+ */
+static void clear_directory_cluster(FileSystem *fs, uint32_t cluster) {
+    const Fat32BootSector *bpb = &fs->bpb;
+    uint32_t cluster_size =
+        bpb->bytes_per_sector * bpb->sectors_per_cluster;
+
+    unsigned char *buf = (unsigned char *)calloc(1, cluster_size);
+    if (!buf) return;
+
+    buf_cache_write_meta(&fs->buf_cache, cluster, 0, buf, cluster_size);
+
+    free(buf);
+}
+
+/* MULTICLUSTER SAFE
+ * directory_index()
+ * Name table of directory 'dir', built by one scan of its chain the first
+ * time the directory is searched. The same scan notes the deleted slots, the
+ * end marker and the last cluster for placing new entries. NULL if it cannot
+ * be built, the caller then scans.
+ */
+static DirIndexSlot* directory_index(FileSystem *fs, uint32_t dir) {
+
+    DirIndexSlot *slot = dir_index_get(&fs->dir_index, dir);
+
+    if (slot)
+        return slot;
+
+    slot = dir_index_create(&fs->dir_index, dir);
+
+    if (!slot)
+        return NULL;
+
+    const Fat32BootSector *bpb = &fs->bpb;
+    uint32_t cluster_size = bpb->bytes_per_sector * bpb->sectors_per_cluster;
+    uint32_t per_cluster = cluster_size / 32;
+
+    uint32_t cur = dir;
+    uint32_t dir_pos = 0;
+    const ExtentMap *dir_chain = chain_extents(fs, cur);
+
+    prefetch_directory(fs, dir_chain);
+
+    while (1) {
+
+        //past the end marker only the length of the chain and its last cluster are wanted
+        if (!slot->has_end) {
+
+            const unsigned char *data = pin_cluster(fs, cur);
+
+            if (!data) {
+                dir_index_drop(&fs->dir_index, dir);
+                return NULL;
+            }
+
+            for (uint32_t off = 0; off < cluster_size; off += 32) {
+
+                const unsigned char *entry = data + off;
+                DirSlot at = { dir_pos * per_cluster + off / 32, cur, off };
+                bool ok = true;
+
+                if (entry[0] == 0x00) {
+                    slot->end = at;
+                    slot->has_end = true;
+                    break;
+                }
+
+                if (entry[0] == 0xE5)
+                    ok = dir_index_release_slot(slot, &at); //deleted, free for the next entry
+                else if ((entry[11] & 0x0F) == 0x0F)
+                    continue; //long name
+                else if (!dir_index_find(slot, (const char *) entry)) //a duplicate name resolves to the first one, like a scan would
+                    ok = dir_index_insert(slot, (const char *) entry, &at, entry[11]);
+
+                if (!ok) {
+                    unpin_cluster(fs, cur);
+                    dir_index_drop(&fs->dir_index, dir);
+                    return NULL;
+                }
+            }
+
+            unpin_cluster(fs, cur);
+        }
+
+        uint32_t next = chain_next(fs, dir_chain, &dir_pos, cur);
+
+        if (next == 0 || dir_pos > fs->total_clusters)
+            break;
+
+        cur = next;
+    }
+
+    slot->tail = cur;
+    slot->num_clusters = dir_pos;
+
+    return slot;
+}
+
+/*
+ * dir_entry_added() / dir_entry_removed() / dir_entry_renamed()
+ * An entry called short_name was written at slot 'at', deleted, or renamed
+ * in place in directory 'dir': its name table, if it has one, follows along
+ * (or is dropped if it cannot) and whatever the dentry cache knew about the
+ * names is forgotten.
+ */
+static void dir_entry_added(FileSystem *fs, uint32_t dir, const char short_name[11],
+                            const DirSlot *at, uint8_t attr) {
+
+    DirIndexSlot *slot = dir_index_get(&fs->dir_index, dir);
+
+    if (slot && !dir_index_insert(slot, short_name, at, attr))
+        dir_index_drop(&fs->dir_index, dir);
+
+    dentry_cache_forget(&fs->dentry_cache, dir, short_name);
+}
+
+static void dir_entry_removed(FileSystem *fs, uint32_t dir, const char short_name[11]) {
+
+    DirIndexSlot *slot = dir_index_get(&fs->dir_index, dir);
+
+    if (slot) {
+
+        const DirIndexEntry *e = dir_index_find(slot, short_name);
+
+        if (e) {
+
+            DirSlot at = e->at;
+
+            dir_index_remove(slot, short_name);
+
+            //its slot takes the next new entry
+            if (!dir_index_release_slot(slot, &at))
+                dir_index_drop(&fs->dir_index, dir);
+        }
+    }
+
+    dentry_cache_forget(&fs->dentry_cache, dir, short_name);
+}
+
+static void dir_entry_renamed(FileSystem *fs, uint32_t dir, const char old_name[11],
+                              const char new_name[11], uint8_t attr) {
+
+    DirIndexSlot *slot = dir_index_get(&fs->dir_index, dir);
+
+    if (slot) {
+
+        const DirIndexEntry *e = dir_index_find(slot, old_name);
+
+        if (e) {
+
+            DirSlot at = e->at;
+
+            dir_index_remove(slot, old_name);
+
+            if (!dir_index_insert(slot, new_name, &at, attr))
+                dir_index_drop(&fs->dir_index, dir);
+        }
+        else {
+            dir_index_drop(&fs->dir_index, dir);
+        }
+    }
+
+    dentry_cache_forget(&fs->dentry_cache, dir, old_name);
+    dentry_cache_forget(&fs->dentry_cache, dir, new_name);
+}
+
+/*
+ * extend_directory()
+ * Appends a zeroed cluster to the directory chain ending at 'last'. Returns
+ * the new cluster, 0 if there is no space.
+ */
+static uint32_t extend_directory(FileSystem *fs, uint32_t last) {
+
+    uint32_t new_dir_cluster = allocate_cluster(fs);
+
+    if (new_dir_cluster == 0)
+        return 0;
+
+    write_fat_entry(fs, last, new_dir_cluster);
+    write_fat_entry(fs, new_dir_cluster, FAT32_EOC);
+
+    //no leftovers from whatever used the cluster before
+    clear_directory_cluster(fs, new_dir_cluster);
+
+    return new_dir_cluster;
+}
+
+/* MULTICLUSTER SAFE
+ * take_directory_slot()
+ * Slot for a new entry in directory 'dir': the first deleted entry, else the
+ * end marker, else the start of a cluster appended to the directory. With a
+ * name table this comes from what the table keeps and costs no scan;
+ * without one the chain is scanned. Prints an error and returns false if
+ * there is no slot. A slot that ends up unused goes back with
+ * give_back_directory_slot().
+ */
+static bool take_directory_slot(FileSystem *fs, uint32_t dir, DirSlot *out) {
+
+    const Fat32BootSector *bpb = &fs->bpb;
+    uint32_t cluster_size = bpb->bytes_per_sector * bpb->sectors_per_cluster;
+    uint32_t per_cluster = cluster_size / 32;
+
+    DirIndexSlot *slot = directory_index(fs, dir);
+
+    if (slot) {
+
+        if (dir_index_take_slot(slot, out))
+            return true;
+
+        if (slot->has_end) {
+
+            *out = slot->end;
+
+            //the marker moves one slot on, into the next cluster of the chain if need be
+            slot->end.slot++;
+            slot->end.offset += 32;
+
+            if (slot->end.offset == cluster_size) {
+
+                uint32_t index = out->slot / per_cluster;
+                uint32_t next = chain_next(fs, chain_extents(fs, dir), &index, out->cluster);
+
+                slot->end.cluster = next;
+                slot->end.offset = 0;
+                slot->has_end = (next != 0);
+            }
+
+            return true;
+        }
+
+        uint32_t new_dir_cluster = extend_directory(fs, slot->tail);
+
+        if (new_dir_cluster == 0) {
+            printf("Error: no free clusters available to expand directory\n");
+            return false;
+        }
+
+        out->slot = slot->num_clusters * per_cluster;
+        out->cluster = new_dir_cluster;
+        out->offset = 0;
+
+        slot->tail = new_dir_cluster;
+        slot->num_clusters++;
+
+        slot->end.slot = out->slot + 1;
+        slot->end.cluster = new_dir_cluster;
+        slot->end.offset = 32;
+        slot->has_end = (per_cluster > 1);
+
+        return true;
+    }
+
+    //no table, scan
+    uint32_t cur = dir;
+    uint32_t dir_pos = 0;
+    const ExtentMap *dir_chain = chain_extents(fs, cur);
+
+    prefetch_directory(fs, dir_chain);
+
+    while (1) {
+
+        const unsigned char *data = pin_cluster(fs, cur);
+
+        if (!data) {
+            printf("Error: failed to read directory cluster\n");
+            return false;
+        }
+
+        for (uint32_t off = 0; off < cluster_size; off += 32) {
+
+            //end marker or deleted entry, first one wins
+            if (data[off] == 0x00 || data[off] == 0xE5) {
+
+                out->slot = dir_pos * per_cluster + off / 32;
+                out->cluster = cur;
+                out->offset = off;
+
+                unpin_cluster(fs, cur);
+                return true;
+            }
+        }
+
+        unpin_cluster(fs, cur);
+
+        uint32_t next = chain_next(fs, dir_chain, &dir_pos, cur);
+
+        if (next == 0)
+            break;
+
+        cur = next;
+    }
+
+    uint32_t new_dir_cluster = extend_directory(fs, cur);
+
+    if (new_dir_cluster == 0) {
+        printf("Error: no free clusters available to expand directory\n");
+        return false;
+    }
+
+    out->slot = dir_pos * per_cluster;
+    out->cluster = new_dir_cluster;
+    out->offset = 0;
+
+    return true;
+}
+
+//a slot from take_directory_slot() that was not written after all
+static void give_back_directory_slot(FileSystem *fs, uint32_t dir, const DirSlot *at) {
+
+    DirIndexSlot *slot = dir_index_get(&fs->dir_index, dir);
+
+    if (slot && !dir_index_release_slot(slot, at))
+        dir_index_drop(&fs->dir_index, dir);
+}
+
+/* MULTICLUSTER SAFE
+ * lookup_entry()
+ * Finds short_name in directory 'dir'. On success the 32-byte entry is copied
+ * to 'out' and its directory cluster and offset in that cluster are returned.
+ * Answered from the directory's index, a miss there is final. Without an
+ * index, or if the index no longer matches the cluster, the chain is scanned.
+ */
+static bool lookup_entry(FileSystem *fs, uint32_t dir, const char short_name[11],
+                         unsigned char out[32], uint32_t *cluster_num, uint32_t *cluster_offset) {
+
+    DirIndexSlot *slot = directory_index(fs, dir);
+
+    if (slot) {
+
+        const DirIndexEntry *e = dir_index_find(slot, short_name);
+
+        if (!e)
+            return false;
+
+        uint32_t cluster = e->at.cluster;
+        uint32_t offset = e->at.offset;
+        const unsigned char *data = pin_cluster(fs, cluster);
+
+        if (data) {
+
+            bool match = data[offset] != 0xE5 && memcmp(data + offset, short_name, 11) == 0;
+
+            if (match)
+                memcpy(out, data + offset, 32);
+
+            unpin_cluster(fs, cluster);
+
+            if (match) {
+                *cluster_num = cluster;
+                *cluster_offset = offset;
+                return true;
+            }
         }
 
-        /* Skip long name entries (attribute 0x0F) */
-        unsigned char attr = entry[11];
-        if ((attr & 0x0F) == 0x0F) {
-            continue;
-        }
+        dir_index_drop(&fs->dir_index, dir);
+    }
+
+    const Fat32BootSector *bpb = &fs->bpb;
+    uint32_t cluster_size = bpb->bytes_per_sector * bpb->sectors_per_cluster;
+
+    uint32_t cur = dir;
+    uint32_t dir_pos = 0;
+    const ExtentMap *dir_chain = chain_extents(fs, cur);
+
+    prefetch_directory(fs, dir_chain);
+
+    while (1) {
+
+        const unsigned char *data = pin_cluster(fs, cur);
+
+        if (!data) 
+            break;
+
+        for (uint32_t off = 0; off < cluster_size; off += 32) {
+
+            const unsigned char *entry = data + off;
+
+            if (entry[0] == 0x00) {
+                unpin_cluster(fs, cur);
+                return false;
+            }
+            if (entry[0] == 0xE5) 
+                continue; //deleted 
+
+            unsigned char attr = entry[11];
+
+            if ((attr & 0x0F) == 0x0F) 
+                continue; //long name 
 
-        /* Compare short name */
-        if (memcmp(entry, short_name, 11) == 0) {
-            *out_exists = 1;
+            if (memcmp(entry, short_name, 11) == 0) {
+
+                memcpy(out, entry, 32);
+                unpin_cluster(fs, cur);
+
+                *cluster_num = cur;
+                *cluster_offset = off;
+                return true;
+            }
         }
+
+        unpin_cluster(fs, cur);
+
+        cur = chain_next(fs, dir_chain, &dir_pos, cur);
+
+        if (cur == 0) 
+            break;
     }
 
-    free(buf);
-    return 0;
+    return false;
 }
 
 /* MULTICLUSTER SAFE 
     CALLER MUST FREE
-* scan cwd over all clusters looking for an entry matching filename/dirname and returns a pointer to its starting byte
+* looks in cwd for an entry matching filename/dirname and returns a copy of its 32 bytes
 * or NULL if not found returns cluster number of entry if found in cluster num , else NULL , also returns offset in cluster in 'cluster_offset'
 */
 unsigned char* getEntry(char* filename, FileSystem* fs , uint32_t* cluster_num , uint32_t* cluster_offset ) {
@@ -344,66 +1922,262 @@ unsigned char* getEntry(char* filename, FileSystem* fs , uint32_t* cluster_num ,
     char target[11];
     build_short_name(target, filename);
 
-    const Fat32BootSector *bpb = &fs->bpb;
-    uint32_t cluster_size = bpb->bytes_per_sector * bpb->sectors_per_cluster;
-
-    unsigned char *buf = (unsigned char*) malloc(cluster_size);
+    unsigned char entry[32];
 
-    if (!buf) 
+    if (!lookup_entry(fs, fs->cwd_cluster, target, entry, cluster_num, cluster_offset))
         return NULL;
 
-    uint32_t cur = fs->cwd_cluster;
+    unsigned char *ret = (unsigned char*) malloc(32);
 
-    while (1) {
+    if (ret) 
+        memcpy(ret, entry, 32);
+
+    return ret;
+}
 
-        long dir_offset = cluster_to_offset(fs, cur);
+static void ref_from_entry(DirEntryRef *ref, uint32_t dir, const unsigned char *entry) {
 
-        if (fseek(fs->image, dir_offset, SEEK_SET) != 0) 
-            break;
-        if (fread(buf, 1, cluster_size, fs->image) != cluster_size)
-             break;
+    memcpy(ref->name, entry, 11);
+    ref->attr = entry[11];
+    ref->first_cluster = ((uint32_t)entry[21] << 24) | ((uint32_t)entry[20] << 16) |
+                         ((uint32_t)entry[27] << 8) | (uint32_t)entry[26];
+    ref->size = read_le32(entry + 28);
+    ref->dir_cluster = dir;
+}
 
-        for (uint32_t off = 0; off < cluster_size; off += 32) {
+/*
+ * remember_ref()
+ * Puts what ref says about its entry in the dentry cache.
+ */
+static void remember_ref(FileSystem *fs, const DirEntryRef *ref) {
 
-            unsigned char *entry = buf + off;
+    Dentry d;
+    memset(&d, 0, sizeof(d));
 
-            if (entry[0] == 0x00) 
-                goto not_found;
-            if (entry[0] == 0xE5) 
-                continue; //deleted 
+    d.parent = ref->dir_cluster;
+    memcpy(d.name, ref->name, 11);
+    d.attr = ref->attr;
+    d.first_cluster = ref->first_cluster;
+    d.size = ref->size;
+    d.entry_cluster = ref->entry_cluster;
+    d.entry_offset = ref->entry_offset;
 
-            unsigned char attr = entry[11];
+    dentry_cache_put(&fs->dentry_cache, &d);
+}
 
-            if ((attr & 0x0F) == 0x0F) 
-                continue; //long name 
+/* MULTICLUSTER SAFE
+ * resolve_in()
+ * Looks short_name up in directory 'dir' and fills *ref. The dentry cache
+ * answers first; a miss goes to the directory and its outcome is cached.
+ * A name found missing is only cached as such when the directory's index
+ * said so, a scan that stopped on a read error proves nothing.
+ */
+static bool resolve_in(FileSystem *fs, uint32_t dir, const char short_name[11], DirEntryRef *ref) {
 
-            if (memcmp(entry, target, 11) == 0) {
-                
-                unsigned char *ret = (unsigned char*) malloc(32);
+    const Dentry *d = dentry_cache_get(&fs->dentry_cache, dir, short_name);
 
-                if (ret) 
-                    memcpy(ret, entry, 32);
+    if (d) {
 
-                free(buf);
+        if (d->negative)
+            return false;
 
-                *cluster_num = cur;
-                *cluster_offset = off;
-                return ret;
-            }
+        memcpy(ref->name, d->name, 11);
+        ref->attr = d->attr;
+        ref->first_cluster = d->first_cluster;
+        ref->size = d->size;
+        ref->dir_cluster = dir;
+        ref->entry_cluster = d->entry_cluster;
+        ref->entry_offset = d->entry_offset;
+        return true;
+    }
+
+    unsigned char entry[32];
+
+    if (!lookup_entry(fs, dir, short_name, entry, &ref->entry_cluster, &ref->entry_offset)) {
+
+        if (dir_index_get(&fs->dir_index, dir)) {
+
+            Dentry miss;
+            memset(&miss, 0, sizeof(miss));
+
+            miss.parent = dir;
+            memcpy(miss.name, short_name, 11);
+            miss.negative = true;
+
+            dentry_cache_put(&fs->dentry_cache, &miss);
+        }
+
+        return false;
+    }
+
+    ref_from_entry(ref, dir, entry);
+    remember_ref(fs, ref);
+
+    return true;
+}
+
+/* MULTICLUSTER SAFE
+ * fs_resolve()
+ * One lookup of 'name' in the current working directory, everything a
+ * command needs from the entry goes into *ref.
+ */
+bool fs_resolve(FileSystem *fs, const char *name, DirEntryRef *ref) {
+
+    if (!name || !fs || !fs->image || !ref)
+        return false;
+
+    char target[11];
+    build_short_name(target, name);
+
+    return resolve_in(fs, fs->cwd_cluster, target, ref);
+}
+
+static void root_ref(const FileSystem *fs, DirEntryRef *ref) {
+
+    memset(ref, 0, sizeof(*ref));
+    memset(ref->name, ' ', 11);
+
+    ref->name[0] = '/';
+    ref->attr = 0x10;
+    ref->first_cluster = fs->bpb.root_cluster;
+}
+
+/*
+ * cwd_path_push()
+ * Appends a level below the deepest one. On OOM the path is marked invalid
+ * instead, which only costs getcwd() a tree walk.
+ */
+static void cwd_path_push(CwdPath *path, uint32_t cluster, const char short_name[11]) {
+
+    if (!path->valid)
+        return;
+
+    if (path->depth == path->capacity) {
+
+        uint32_t capacity = (path->capacity == 0) ? 8 : path->capacity * 2;
+        CwdLevel *levels = (CwdLevel *) realloc(path->levels, capacity * sizeof(CwdLevel));
+
+        if (!levels) {
+            path->valid = false;
+            return;
         }
 
+        path->levels = levels;
+        path->capacity = capacity;
+    }
+
+    CwdLevel *level = &path->levels[path->depth++];
+
+    level->cluster = cluster;
+    format_short_name(level->name, short_name);
+}
+
+static void cwd_path_copy(CwdPath *dest, const CwdPath *src) {
+
+    memset(dest, 0, sizeof(*dest));
+    dest->valid = src->valid;
+
+    if (!src->valid || src->depth == 0)
+        return;
+
+    dest->levels = (CwdLevel *) malloc(src->depth * sizeof(CwdLevel));
 
-        uint32_t next = read_fat_entry(fs, cur);
+    if (!dest->levels) {
+        dest->valid = false;
+        return;
+    }
+
+    memcpy(dest->levels, src->levels, src->depth * sizeof(CwdLevel));
+    dest->depth = src->depth;
+    dest->capacity = src->depth;
+}
+
+static void cwd_path_reset(CwdPath *path) {
+
+    path->depth = 0;
+    path->valid = true; //back at the root the path is known again
+}
+
+/* MULTICLUSTER SAFE
+ * walk_path()
+ * Starts at the root for "/..." and at the cwd otherwise, then resolves one
+ * component per step through resolve_in(), so a path walked before costs
+ * one dentry cache hit per level. Every component but the last has to be a
+ * directory. The root has no "." or ".." entries, both lead back to it.
+ * When 'trail' is given (a copy of the cwd's CwdPath) it is moved along
+ * with every directory stepped into or out of.
+ */
+static bool walk_path(FileSystem *fs, const char *path, DirEntryRef *ref, CwdPath *trail) {
+
+    uint32_t root = fs->bpb.root_cluster;
+    uint32_t dir = (path[0] == '/') ? root : fs->cwd_cluster;
+    const char *p = path;
+    bool any = false;
+
+    root_ref(fs, ref);
 
-        if (next == 0x0FFFFFFF || next == 0) 
+    if (trail && path[0] == '/')
+        cwd_path_reset(trail);
+
+    while (*p) {
+
+        while (*p == '/')
+            p++;
+
+        if (*p == '\0')
             break;
 
-        cur = next;
+        size_t len = strcspn(p, "/");
+
+        //the previous component was a file, or the name cannot be a short name
+        if (dir == 0 || len > 11)
+            return false;
+
+        char component[12];
+        memcpy(component, p, len);
+        component[len] = '\0';
+
+        bool dot = strcmp(component, ".") == 0;
+        bool dotdot = strcmp(component, "..") == 0;
+
+        if (dir == root && (dot || dotdot)) {
+            root_ref(fs, ref);
+        }
+        else {
+
+            char short_name[11];
+            build_short_name(short_name, component);
+
+            if (!resolve_in(fs, dir, short_name, ref))
+                return false;
+        }
+
+        if (ref->attr & 0x10) {
+
+            //".." of a directory right below the root says 0
+            if (ref->first_cluster == 0)
+                ref->first_cluster = root;
+
+            dir = ref->first_cluster;
+
+            if (trail) {
+                if (dir == root)
+                    cwd_path_reset(trail);
+                else if (dotdot && trail->depth > 0)
+                    trail->depth--;
+                else if (!dot)
+                    cwd_path_push(trail, dir, ref->name);
+            }
+        }
+        else {
+            dir = 0;
+        }
+
+        p += len;
+        any = true;
     }
 
-not_found:
-    free(buf);
-    return NULL;
+    return any || path[0] == '/';
 }
 
 /* write_directory_entry() UNSURE MULTICLUSTER
@@ -433,20 +2207,15 @@ static void write_directory_entry(FileSystem *fs,
     entry[30] = (unsigned char)((file_size >> 16) & 0xFF);
     entry[31] = (unsigned char)((file_size >> 24) & 0xFF);
 
-    if (fseek(fs->image, entry_offset, SEEK_SET) != 0) {
-        return;
-    }
-    
-    size_t written = fwrite(entry, sizeof(entry), 1, fs->image);
-    if (written != 1) {
-        fprintf(stderr, "fwrite failed to write directory entry\n");
+    if (!image_write(fs, (uint64_t)entry_offset, entry, sizeof(entry))) {
+        fprintf(stderr, "failed to write directory entry\n");
     }
 
 }
 
 /*MULTICLUSTER SAFE
  * Creates a directory and allocates a starting cluster.
- * Scans the entire directory chain (following FAT) to find a free entry slot.
+ * The entry goes in the directory's first free slot, see take_directory_slot().
  * Returns true on success, false on failure.
  */
 bool fs_mkdir(FileSystem *fs, const char *name) {
@@ -465,105 +2234,25 @@ bool fs_mkdir(FileSystem *fs, const char *name) {
     char short_name[11];
     build_short_name(short_name, name);
 
-    const Fat32BootSector *bpb = &fs->bpb;
-    uint32_t cluster_size = bpb->bytes_per_sector * bpb->sectors_per_cluster;
+    //already exists
+    unsigned char existing[32];
+    uint32_t existing_cluster, existing_off;
 
-    unsigned char *buf = (unsigned char *)malloc(cluster_size);
-    if (!buf) {
-        printf("Error: memory allocation failed\n");
+    if (lookup_entry(fs, fs->cwd_cluster, short_name, existing, &existing_cluster, &existing_off)) {
+        printf("Error: directory/file '%s' already exists\n", name);
         return false;
     }
 
-    //scnan
-    long free_offset = -1;
-    uint32_t cur = fs->cwd_cluster;
-
-    while (1) {
-        long dir_offset = cluster_to_offset(fs, cur);
-        if (fseek(fs->image, dir_offset, SEEK_SET) != 0) {
-            printf("Error: failed to seek to directory cluster\n");
-            free(buf);
-            return false;
-        }
-        if (fread(buf, 1, cluster_size, fs->image) != cluster_size) {
-            printf("Error: failed to read directory cluster\n");
-            free(buf);
-            return false;
-        }
-
-        for (uint32_t off = 0; off < cluster_size; off += 32) {
-            unsigned char *entry = buf + off;
-
-            //end of fre
-            if (entry[0] == 0x00) {
-                if (free_offset == -1) {
-                    free_offset = dir_offset + (long)off;
-                }
-                goto found_slot;
-            }
-
-            if (entry[0] == 0xE5) { //deleted
-                if (free_offset == -1) {
-                    free_offset = dir_offset + (long)off;
-                }
-                continue;
-            }
-
-            //skip
-            unsigned char attr = entry[11];
-
-            if ((attr & 0x0F) == 0x0F) 
-                continue;
-
-            //already exists
-            if (memcmp(entry, short_name, 11) == 0) {
-                printf("Error: directory/file '%s' already exists\n", name);
-                free(buf);
-                return false;
-            }
-        }
-
-        //next cluster
-        uint32_t next = read_fat_entry(fs, cur);
-
-        if (next == FAT32_EOC || next == 0) 
-            break;
-
-        cur = next;
-    }
-
-    found_slot:
-
-    free(buf);
-
-    if (free_offset == -1) {
-        //allocate
-        uint32_t new_dir_cluster = allocate_cluster(fs);
-
-        if (new_dir_cluster == 0) {
-            printf("Error: no free clusters available to expand directory\n");
-            return false;
-        }
-
-        /// ad to linked list
-        uint32_t last_cluster = fs->cwd_cluster;
-        uint32_t next;
-
-        while ((next = read_fat_entry(fs, last_cluster)) != FAT32_EOC && next != 0) {
-            last_cluster = next;
-        }
-
-        write_fat_entry(fs, last_cluster, new_dir_cluster);
-        write_fat_entry(fs, new_dir_cluster, FAT32_EOC);
+    DirSlot at;
 
-        ///we have a free slot
-        free_offset = cluster_to_offset(fs, new_dir_cluster);
-    }
+    if (!take_directory_slot(fs, fs->cwd_cluster, &at))
+        return false;
 
     //oooof
     uint32_t new_cluster = allocate_cluster(fs);
     if (new_cluster == 0) {
         printf("Error: no free clusters available\n");
+        give_back_directory_slot(fs, fs->cwd_cluster, &at);
         return false;
     }
 
@@ -571,17 +2260,20 @@ bool fs_mkdir(FileSystem *fs, const char *name) {
     init_directory_cluster(fs, new_cluster, fs->cwd_cluster);
 
     //make it a direc!
-    write_directory_entry(fs, free_offset, short_name,
+    write_directory_entry(fs, cluster_to_offset(fs, at.cluster) + (long)at.offset, short_name,
                           0x10,
                           new_cluster,
                           0);
 
+    dir_entry_added(fs, fs->cwd_cluster, short_name, &at, 0x10);
+
+    fs_commit(fs);
     return true;
 }
 
 /* MULTICLUSTER SAFE
  * Creates an empty file with size = 0 and allocates a starting cluster.
- * Scans the entire directory chain (following FAT) to find a free entry slot.
+ * The entry goes in the directory's first free slot, see take_directory_slot().
  */
 bool fs_creat(FileSystem *fs, const char *name) {
 
@@ -590,141 +2282,47 @@ bool fs_creat(FileSystem *fs, const char *name) {
         return false;
     }
 
-    size_t len = strlen(name);
-    if (len == 0 || len > 11) {
-        printf("Error: FILENAME must be 1–11 characters\n");
-        return false;
-    }
-
-    char short_name[11];
-
-    build_short_name(short_name, name);
-
-    const Fat32BootSector *bpb = &fs->bpb;
-    uint32_t cluster_size = bpb->bytes_per_sector * bpb->sectors_per_cluster;
-
-    unsigned char *buf = (unsigned char *)malloc(cluster_size);
-
-    if (!buf) {
-        printf("Error: memory allocation failed\n");
-        return false;
-    }
-
-    //scan
-    long free_offset = -1;
-    uint32_t cur = fs->cwd_cluster;
-
-    while (1) {
-
-        long dir_offset = cluster_to_offset(fs, cur);
-
-        if (fseek(fs->image, dir_offset, SEEK_SET) != 0) {
-
-            printf("Error: failed to seek to directory cluster\n");
-
-            free(buf);
-            return false;
-        }
-        if (fread(buf, 1, cluster_size, fs->image) != cluster_size) {
-
-            printf("Error: failed to read directory cluster\n");
-
-            free(buf);
-            return false;
-        }
-
-        for (uint32_t off = 0; off < cluster_size; off += 32) {
-
-            unsigned char *entry = buf + off;
-
-            if (entry[0] == 0x00) {
-
-                if (free_offset == -1) {
-
-                    free_offset = dir_offset + (long)off;
-                }
-
-                goto found_slot;
-            }
-
-
-            if (entry[0] == 0xE5) {
-
-                if (free_offset == -1) {
-
-                    free_offset = dir_offset + (long)off;
-                }
-
-                continue;
-            }
-
-
-            unsigned char attr = entry[11];
-
-            if ((attr & 0x0F) == 0x0F) 
-                continue;
-
-            /* Check if name already exists */
-            if (memcmp(entry, short_name, 11) == 0) {
-
-                printf("Error: file '%s' already exists\n", name);
-
-                free(buf);
-                return false;
-            }
-        }
-
-        //next cluster
-        uint32_t next = read_fat_entry(fs, cur);
-
-        if (next == FAT32_EOC || next == 0) 
-            break;
-
-        cur = next;
-    }
-
-    found_slot:
-    free(buf);
+    size_t len = strlen(name);
+    if (len == 0 || len > 11) {
+        printf("Error: FILENAME must be 1–11 characters\n");
+        return false;
+    }
 
-    if (free_offset == -1) {
-        
-        //allocate more space
-        uint32_t new_dir_cluster = allocate_cluster(fs);
+    char short_name[11];
 
-        if (new_dir_cluster == 0) {
-            printf("Error: no free clusters available to expand directory\n");
-            return false;
-        }
+    build_short_name(short_name, name);
 
-        //add to LL
-        uint32_t last_cluster = fs->cwd_cluster;
-        uint32_t next;
+    /* Check if name already exists */
+    unsigned char existing[32];
+    uint32_t existing_cluster, existing_off;
 
-        while ((next = read_fat_entry(fs, last_cluster)) != FAT32_EOC && next != 0) {
-            last_cluster = next;
-        }
+    if (lookup_entry(fs, fs->cwd_cluster, short_name, existing, &existing_cluster, &existing_off)) {
+        printf("Error: file '%s' already exists\n", name);
+        return false;
+    }
 
-        write_fat_entry(fs, last_cluster, new_dir_cluster);
-        write_fat_entry(fs, new_dir_cluster, FAT32_EOC);
+    DirSlot at;
 
-        //new slot start
-        free_offset = cluster_to_offset(fs, new_dir_cluster);
-    }
+    if (!take_directory_slot(fs, fs->cwd_cluster, &at))
+        return false;
 
-    
     uint32_t start_cluster = allocate_cluster(fs);
 
     if (start_cluster == 0) {
         printf("Error: no free clusters available\n");
+        give_back_directory_slot(fs, fs->cwd_cluster, &at);
         return false;
     }
 
     //allocated
-    write_directory_entry(fs, free_offset, short_name,
+    write_directory_entry(fs, cluster_to_offset(fs, at.cluster) + (long)at.offset, short_name,
                           0x20,
                           start_cluster,
                           0);
 
+    dir_entry_added(fs, fs->cwd_cluster, short_name, &at, 0x20);
+
+    fs_commit(fs);
     return true;
 }
 
@@ -739,34 +2337,29 @@ void fs_ls( FileSystem *fs ) {
     const Fat32BootSector *bpb = &fs->bpb;
     uint32_t cluster_size = bpb->bytes_per_sector * bpb->sectors_per_cluster;
 
-    unsigned char *buf = (unsigned char *)malloc(cluster_size);
-
-    if (!buf) {
-        printf("Error: memory allocation failed\n");
-        return;
-    }
-
     uint32_t cur = fs->cwd_cluster;
+    uint32_t dir_index = 0;
+    const ExtentMap *dir_chain = chain_extents(fs, cur);
+
+    prefetch_directory(fs, dir_chain);
 
     while (1) {
 
-        long dir_offset = cluster_to_offset(fs, cur);
+        const unsigned char *data = pin_cluster(fs, cur);
 
-        if (fseek(fs->image, dir_offset, SEEK_SET) != 0) {
-            printf("Error: failed to seek to directory cluster %u\n", cur);
-            break;
-        }
-        if (fread(buf, 1, cluster_size, fs->image) != cluster_size) {
+        if (!data) {
             printf("Error: failed to read directory cluster %u\n", cur);
             break;
         }
 
         for (uint32_t off = 0; off < cluster_size; off += 32) {
 
-            unsigned char *entry = buf + off;
+            const unsigned char *entry = data + off;
 
-            if (entry[0] == 0x00) 
-                goto done;
+            if (entry[0] == 0x00) {
+                unpin_cluster(fs, cur);
+                return;
+            }
             if (entry[0] == 0xE5) 
                 continue;
 
@@ -783,22 +2376,20 @@ void fs_ls( FileSystem *fs ) {
             printf("%s\n", name);
         }
 
+        unpin_cluster(fs, cur);
+
         // next clus
-        uint32_t next = read_fat_entry((FileSystem*)fs, cur);
+        cur = chain_next(fs, dir_chain, &dir_index, cur);
 
-        if (next == FAT32_EOC || next == 0) 
+        if (cur == 0) 
             break;
-
-        cur = next;
     }
-
-done:
-    free(buf);
 }
 
 
 /* MULTICLUSTER SAFE
- * Changes the current working directory to DIRNAME.
+ * Changes the current working directory to DIRNAME, which may be an
+ * absolute or relative path of several components.
  * Returns true on success, false on failure.
  * Prints an error message if DIRNAME does not exist or is not a directory.
  */
@@ -809,47 +2400,43 @@ bool fs_cd(FileSystem *fs, const char *dirname) {
         return false;
     }
 
+    //the walk moves a copy, the cwd only changes if it succeeds
+    CwdPath trail;
+    cwd_path_copy(&trail, &fs->cwd_path);
 
-    uint32_t entry_cluster_num = 0; //this holds the starting cluster number of filename on success
-    uint32_t cluster_offset = 0; //this holds the offset of the start of the entry in the cluster on success
-
-    unsigned char* entry = getEntry( (char*)dirname , fs , &entry_cluster_num , &cluster_offset );
+    DirEntryRef ref;
 
-    if( entry == NULL ) {
+    if (!walk_path(fs, dirname, &ref, &trail)) {
         printf("Error: directory does not exist.\n");
+        free(trail.levels);
         return false;
     }
 
-    if ( !(entry[11] & 0x10) ) { //check is directory
+    if ( !(ref.attr & 0x10) ) { //check is directory
         printf("Error: Not a Directory.\n");
-        free(entry);
+        free(trail.levels);
         return false;
     }
 
-    //we know dirname is a directory in cwd and now have its entry
-
-    uint32_t target_cluster = ((uint32_t)entry[21] << 24) | ((uint32_t)entry[20] << 16) |
-                    ((uint32_t)entry[27] << 8) | (uint32_t)entry[26];
+    /* Update current working directory */
+    fs->cwd_cluster = ref.first_cluster;
 
-    /* In FAT32, if target cluster is 0, it means the root directory */
-    if (target_cluster == 0) {
-        target_cluster = fs->bpb.root_cluster;
-    }
+    free(fs->cwd_path.levels);
+    fs->cwd_path = trail;
 
-    /* Update current working directory */
-    fs->cwd_cluster = target_cluster;
-    free(entry);
     return true;
 }
 
-/* getcwd() MULTILUSTER SAFE
+/* walk_cwd() MULTILUSTER SAFE
  * Builds a full path from the current working directory by walking up
  * the directory tree following the ".." entries until the root cluster.
+ * Each parent's whole chain is searched for the child's name.
+ * Only used when fs->cwd_path cannot be trusted.
  * Returns a dynamically allocatew c string and its size ( caller must free ) containing the
  * path in the form "/dir1/dir2". root returns "/".
 */
 
-CurrentDirectory getcwd( FileSystem *fs ) {
+static CurrentDirectory walk_cwd( FileSystem *fs ) {
 
     const Fat32BootSector *bpb = &fs->bpb;
     uint32_t root = bpb->root_cluster;
@@ -884,22 +2471,15 @@ CurrentDirectory getcwd( FileSystem *fs ) {
 
         uint32_t cluster_size = bpb->bytes_per_sector * bpb->sectors_per_cluster;
 
-        unsigned char* buf = (unsigned char*) malloc(cluster_size);
+        const unsigned char* buf = pin_cluster(fs, cluster);
 
         if (!buf) break;
 
-        long dir_offset = cluster_to_offset(fs, cluster);
-        if (fseek(fs->image, dir_offset, SEEK_SET) != 0 ||
-            fread(buf, 1, cluster_size, fs->image) != cluster_size) {
-            free(buf);
-            break;
-        }
-
         uint32_t parent = 0;
         // Find the entry for ".." 
         for (uint32_t off = 0; off < cluster_size; off += 32) {
 
-            unsigned char *entry = buf + off;
+            const unsigned char *entry = buf + off;
 
             if (entry[0] == 0x00) break;
 
@@ -916,73 +2496,60 @@ CurrentDirectory getcwd( FileSystem *fs ) {
             }
         }
 
-        free(buf);
+        unpin_cluster(fs, cluster);
 
         if (parent == 0) {  
             parent = root;
         }
 
 
-        cluster_size = bpb->bytes_per_sector * bpb->sectors_per_cluster;
-        buf = (unsigned char*)malloc(cluster_size);
-        if (!buf) break;
-
-        dir_offset = cluster_to_offset(fs, parent);
-        if (fseek(fs->image, dir_offset, SEEK_SET) != 0 ||
-            fread(buf, 1, cluster_size, fs->image) != cluster_size) {
-            free(buf);
-            break;
-        }
-
+        //the parent's entry for cur can be in any cluster of the parent's chain
         char found_name[13];
         bool found = false;
+        bool at_end = false;
+        uint32_t pcur = parent;
+        uint32_t ppos = 0;
+        const ExtentMap *parent_chain = chain_extents(fs, parent);
 
-        for (uint32_t off = 0; off < cluster_size; off += 32) {
-            unsigned char *entry = buf + off;
+        while (pcur != 0 && !found && !at_end && ppos <= fs->total_clusters) {
 
-            if (entry[0] == 0x00) break;
+            buf = pin_cluster(fs, pcur);
+            if (!buf) break;
 
-            if (entry[0] == 0xE5) continue;
+            for (uint32_t off = 0; off < cluster_size; off += 32) {
+                const unsigned char *entry = buf + off;
 
-            unsigned char attr = entry[11];
-            
-            if ((attr & 0x0F) == 0x0F) continue; // long name
-
-            // Extract cluster of this entry 
-            uint32_t ent_cluster =
-                ((uint32_t)entry[21] << 24) |
-                ((uint32_t)entry[20] << 16) |
-                ((uint32_t)entry[27] <<  8) |
-                (uint32_t)entry[26];
-
-            if (ent_cluster == cur) {
-
-                char name_part[9];
-                char ext_part[4];
-                memcpy(name_part, entry, 8);
-                name_part[8] = '\0';
-                memcpy(ext_part, entry + 8, 3);
-                ext_part[3] = '\0';
-
-                for (int i = 7; i >= 0; --i) {
-                    if (name_part[i] == ' ') name_part[i] = '\0'; else break;
-                }
-                for (int i = 2; i >= 0; --i) {
-                    if (ext_part[i] == ' ') ext_part[i] = '\0'; else break;
+                if (entry[0] == 0x00) {
+                    at_end = true;
+                    break;
                 }
 
-                if (ext_part[0] != '\0') {
-                    snprintf(found_name, sizeof(found_name), "%s.%s", name_part, ext_part);
-                } else {
-                    snprintf(found_name, sizeof(found_name), "%s", name_part);
-                }
+                if (entry[0] == 0xE5) continue;
 
-                found = true;
-                break;
+                unsigned char attr = entry[11];
+
+                if ((attr & 0x0F) == 0x0F) continue; // long name
+
+                // Extract cluster of this entry 
+                uint32_t ent_cluster =
+                    ((uint32_t)entry[21] << 24) |
+                    ((uint32_t)entry[20] << 16) |
+                    ((uint32_t)entry[27] <<  8) |
+                    (uint32_t)entry[26];
+
+                if (ent_cluster == cur) {
+
+                    format_short_name(found_name, (const char *) entry);
+
+                    found = true;
+                    break;
+                }
             }
-        }
 
-        free(buf);
+            unpin_cluster(fs, pcur);
+
+            pcur = chain_next(fs, parent_chain, &ppos, pcur);
+        }
 
         if (!found) break;
 
@@ -1062,6 +2629,54 @@ CurrentDirectory getcwd( FileSystem *fs ) {
     return directory;
 }
 
+/* getcwd() MULTILUSTER SAFE
+ * Joins the names on fs->cwd_path, no I/O. Falls back to walking the tree
+ * if the path was lost to an allocation failure or does not end at the cwd.
+ * Returns a dynamically allocated c string ( caller must free ) in the form
+ * "/dir1/dir2", root returns "/".
+ */
+CurrentDirectory getcwd( FileSystem *fs ) {
+
+    const CwdPath *path = &fs->cwd_path;
+    uint32_t top = (path->depth > 0) ? path->levels[path->depth - 1].cluster : fs->bpb.root_cluster;
+
+    if (!path->valid || top != fs->cwd_cluster)
+        return walk_cwd(fs);
+
+    CurrentDirectory directory;
+    size_t total = 2; //leading '/' and the terminator
+
+    for (uint32_t i = 0; i < path->depth; i++)
+        total += strlen(path->levels[i].name) + 1;
+
+    char* s = (char*) malloc(total);
+
+    directory.size = total;
+    directory.cwd = s;
+
+    if (!s) {
+        directory.size = -1; //err
+        return directory;
+    }
+
+    char* p = s;
+    *p++ = '/';
+
+    for (uint32_t i = 0; i < path->depth; i++) {
+
+        size_t len = strlen(path->levels[i].name);
+
+        memcpy(p, path->levels[i].name, len);
+        p += len;
+
+        if (i + 1 < path->depth) *p++ = '/';
+    }
+
+    *p = '\0';
+
+    return directory;
+}
+
 /* checkExists() MULTICLUSTER SAFE
  * Returns 0 if a file/directory with filename exists in the current
  * working directory (fs->cwd_cluster). Returns -1 on error or
@@ -1139,49 +2754,79 @@ uint32_t getStartCluster(char* filename, FileSystem* fs) {
     return start_cluster;
 }
 
-/* NOT MULTICLUSTER SAFE
+/* MULTICLUSTER SAFE
  * find_directory_entry_offset()
  * Searches for a file/directory entry in the current working directory.
  * Returns the byte offset of the entry in the image file, or -1 if not found.
- * Also sets *out_cluster to the starting cluster and *out_attr to attributes.
+ * Also sets *out_cluster to the starting cluster and *out_attr to attributes,
+ * and *entry_cluster / *entry_off to the directory cluster holding the entry
+ * and its offset in there.
  */
 static long find_directory_entry_offset(FileSystem *fs, const char short_name[11],
-                                         uint32_t *out_cluster, uint8_t *out_attr) {
-
-
-    uint32_t entry_cluster_num = 0; //this holds the starting cluster number of filename on success
-    uint32_t cluster_offset = 0; //this holds the offset of the start of the entry in the cluster on success
+                                         uint32_t *out_cluster, uint8_t *out_attr,
+                                         uint32_t *entry_cluster, uint32_t *entry_off) {
 
-    unsigned char* entry = getEntry( (char*)short_name , fs , &entry_cluster_num , &cluster_offset );
+    unsigned char entry[32];
 
-    if( entry == NULL) {
+    if (!lookup_entry(fs, fs->cwd_cluster, short_name, entry, entry_cluster, entry_off))
         return -1;
-    }
 
     *out_attr = entry[11];
     *out_cluster = ((uint32_t)entry[21] << 24) | ((uint32_t)entry[20] << 16) |
                 ((uint32_t)entry[27] << 8) | (uint32_t)entry[26];
 
-    free(entry);
-    return (long) cluster_offset;
-
+    return cluster_to_offset(fs, *entry_cluster) + (long)*entry_off;
 }
 
 /* MULTICLUSTER SAFE
  * free_cluster_chain()
  * Frees all clusters in a cluster chain by marking them as free (0x00000000) in the FAT.
+ * The chain is collected into runs first, then each run is cleared with one
+ * pass per FAT sector and handed back to the free map in bulk.
  */
 static void free_cluster_chain(FileSystem *fs, uint32_t start_cluster) {
 
-    uint32_t cluster = start_cluster;
+    ExtentMap chain;
+    extent_map_init(&chain);
 
-    while (cluster >= 2 && cluster < 0x0FFFFFF8) {
+    //if this was a directory its name table and cached lookups go with it
+    dir_index_drop(&fs->dir_index, start_cluster);
+    dentry_cache_forget_dir(&fs->dentry_cache, start_cluster);
 
-        uint32_t next_cluster = read_fat_entry(fs, cluster);
+    bool complete = build_extent_map(fs, start_cluster, &chain);
 
-        write_fat_entry(fs, cluster, 0x00000000);
-        cluster = next_cluster;
+    //not reusable until the record freeing them is durable
+    if (journal_active(&fs->journal))
+        fs->frees_uncommitted = true;
+
+    for (uint32_t i = 0; i < chain.count; i++) {
+
+        const ClusterExtent *run = &chain.runs[i];
+
+        fat_cache_clear_range(&fs->fat_cache, fs->image, run->start, run->length);
+        chain_cache_invalidate_range(&fs->chain_cache, run->start, run->length);
+        buf_cache_invalidate(&fs->buf_cache, run->start, run->length);
+        free_map_set_free_range(&fs->free_map, run->start, run->length);
+    }
+
+    //out of memory part way: finish the rest of the chain one entry at a time
+    if (!complete && chain.total_clusters <= fs->total_clusters) {
+
+        uint32_t cluster = extent_map_last(&chain);
+        cluster = (cluster == 0) ? start_cluster : read_fat_entry(fs, cluster);
+
+        while (cluster >= 2 && cluster < 0x0FFFFFF8) {
+
+            uint32_t next_cluster = read_fat_entry(fs, cluster);
+
+            write_fat_entry(fs, cluster, 0x00000000);
+            buf_cache_invalidate(&fs->buf_cache, cluster, 1);
+            free_map_set_free(&fs->free_map, cluster);
+            cluster = next_cluster;
+        }
     }
+
+    extent_map_free(&chain);
 }
 
 /* NOT MULTICLUSTER SAFE
@@ -1195,26 +2840,14 @@ static bool is_directory_empty(FileSystem *fs, uint32_t dir_cluster) {
     uint32_t cluster_size = bpb->bytes_per_sector * bpb->sectors_per_cluster;
 
 
-    unsigned char *buf = (unsigned char *) malloc(cluster_size);
-
-    if (!buf) return false;
-
-    long dir_offset = cluster_to_offset(fs, dir_cluster);
-
-
-    if (fseek(fs->image, dir_offset, SEEK_SET) != 0) {
-        free(buf);
-        return false;
-    }
+    const unsigned char *data = pin_cluster(fs, dir_cluster);
 
-    if (fread(buf, 1, cluster_size, fs->image) != cluster_size) {
-        free(buf);
+    if (!data) 
         return false;
-    }
 
     for (uint32_t off = 0; off < cluster_size; off += 32) {
 
-        unsigned char *entry = buf + off;
+        const unsigned char *entry = data + off;
 
         if (entry[0] == 0x00) 
             break;
@@ -1232,11 +2865,11 @@ static bool is_directory_empty(FileSystem *fs, uint32_t dir_cluster) {
         }
 
 
-        free(buf);
+        unpin_cluster(fs, dir_cluster);
         return false;
     }
 
-    free(buf);
+    unpin_cluster(fs, dir_cluster);
     return true;
 }
 
@@ -1286,24 +2919,26 @@ bool fs_rm(FileSystem *fs, char *filename, struct OpenFiles *open_files , char*
 
     unsigned char deleted_marker = 0xE5;
 
-    if (fseek(fs->image, ( cluster_to_offset( fs , entry_cluster_num ) + cluster_offset ) , SEEK_SET) != 0) {
-        printf("Error: failed to seek to directory entry\n");
-        free(entry);
-        return false;
-    }
-    if (fwrite(&deleted_marker, 1, 1, fs->image) != 1) {
+    if (!buf_cache_write_meta(&fs->buf_cache, entry_cluster_num, cluster_offset, &deleted_marker, 1)) {
         printf("Error: failed to mark entry as deleted\n");
         free(entry);
         return false;
     }
 
+    dir_entry_removed(fs, fs->cwd_cluster, (const char *) entry);
 
-    if (entry_cluster_num >= 2) {
-        free_cluster_chain(fs, entry_cluster_num);
+
+    //free the file's own chain, entry_cluster_num is the directory cluster holding the entry
+    uint32_t start_cluster = ((uint32_t)entry[21] << 24) | ((uint32_t)entry[20] << 16) |
+                          ((uint32_t)entry[27] << 8) | (uint32_t)entry[26];
+
+    if (start_cluster >= 2) {
+        free_cluster_chain(fs, start_cluster);
+        chain_cache_invalidate(&fs->chain_cache, start_cluster);
     }
 
 
-    fflush(fs->image);
+    fs_commit(fs);
     free(entry);
     return true;
 }
@@ -1359,28 +2994,29 @@ bool fs_rmdir(FileSystem *fs, const char *dirname, struct OpenFiles *open_files)
     unsigned char deleted_marker = 0xE5;
 
 
-    if (fseek(fs->image, ( cluster_to_offset( fs , entry_cluster_num ) + cluster_offset ) , SEEK_SET) != 0) {
-        printf("Error: failed to seek to directory entry\n");
-        free(entry);
-        return false;
-    }
-    if (fwrite(&deleted_marker, 1, 1, fs->image) != 1) {
+    if (!buf_cache_write_meta(&fs->buf_cache, entry_cluster_num, cluster_offset, &deleted_marker, 1)) {
         printf("Error: failed to mark entry as deleted\n");
         free(entry);
         return false;
     }
 
+    dir_entry_removed(fs, fs->cwd_cluster, (const char *) entry);
+
     /* Free the directory's cluster */
     if (entry_cluster_num >= 2) {
         free_cluster_chain(fs, start_cluster);
+
+        /* Its clusters may still be in the journal, and a replay must never
+         * write them over whatever gets allocated there next */
+        fs->checkpoint_due = true;
     }
 
-    fflush(fs->image); //force
+    fs_commit(fs);
     free(entry);
     return true;
 }
 
-/* NOT MULTICLUSTER SAFE
+/* MULTICLUSTER SAFE
 * fs_mv()
 * moves a file, returns false on failure and may print an error message
 */
@@ -1392,16 +3028,23 @@ bool fs_mv(FileSystem *fs, char *src, char *dest, struct OpenFiles *open_files,
     }
 
     /* Build short names for FAT directory entries */
-    char src_short[11];
-    char dest_short[11];
+    char src_short[12];
+    char dest_short[12];
 
     build_short_name(src_short, src);
     build_short_name(dest_short, dest);
 
+    //these are handed back to getEntry() as names, keep them terminated
+    src_short[11] = '\0';
+    dest_short[11] = '\0';
+
     /* Find source entry in current directory */
     uint32_t src_cluster = 0;
     uint8_t  src_attr    = 0;
-    long src_offset = find_directory_entry_offset(fs, src_short, &src_cluster, &src_attr);
+    uint32_t src_entry_cluster = 0;
+    uint32_t src_entry_off = 0;
+    long src_offset = find_directory_entry_offset(fs, src_short, &src_cluster, &src_attr,
+                                                  &src_entry_cluster, &src_entry_off);
 
     if (src_offset < 0) {
         printf("Error: source '%s' does not exist\n", src);
@@ -1409,8 +3052,7 @@ bool fs_mv(FileSystem *fs, char *src, char *dest, struct OpenFiles *open_files,
     }
 
     /* file must be closed */
-    uint32_t start_cluster = getStartCluster(src_short, fs);
-    if (start_cluster != 0 &&
+    if (src_cluster != 0 &&
         checkIsOpen( open_files, cwd_info->cwd, src) != 0) {
         printf("Error: '%s' is currently open; close it before mv\n", src);
         return false;
@@ -1419,7 +3061,10 @@ bool fs_mv(FileSystem *fs, char *src, char *dest, struct OpenFiles *open_files,
     /* Check if dest is an existing entry in current directory */
     uint32_t dest_cluster = 0;
     uint8_t  dest_attr    = 0;
-    long dest_offset = find_directory_entry_offset(fs, dest_short, &dest_cluster, &dest_attr);
+    uint32_t dest_entry_cluster = 0;
+    uint32_t dest_entry_off = 0;
+    long dest_offset = find_directory_entry_offset(fs, dest_short, &dest_cluster, &dest_attr,
+                                                   &dest_entry_cluster, &dest_entry_off);
 
     /* Reject moving directories*/
     if (src_attr & 0x10) {   // 0x10 = directory attribute
@@ -1430,7 +3075,7 @@ bool fs_mv(FileSystem *fs, char *src, char *dest, struct OpenFiles *open_files,
     /* Case 1: dest exists and is a directory , move into that directory
        (we keep the original name). */
     if (dest_offset >= 0 && (dest_attr & 0x10)) {
-        uint32_t target_dir_cluster = getStartCluster(dest_short, fs);
+        uint32_t target_dir_cluster = dest_cluster;
 
         if (target_dir_cluster == 0) {
             printf("Error: failed to resolve destination directory '%s'\n", dest);
@@ -1439,46 +3084,41 @@ bool fs_mv(FileSystem *fs, char *src, char *dest, struct OpenFiles *open_files,
 
         /* Read the source directory entry */
         unsigned char entry[32];
-        if (fseek(fs->image, src_offset, SEEK_SET) != 0 ||
-            fread(entry, 1, 32, fs->image) != 32) {
+        if (!image_read(fs, (uint64_t)src_offset, entry, 32)) {
             printf("Error: failed to read source directory entry\n");
             return false;
         }
 
-        /* Find a free slot in the destination directory */
-        long free_offset;
-        int exists;
+        /* The name must not be taken in the destination directory */
+        unsigned char taken[32];
+        uint32_t taken_cluster, taken_off;
 
-        /* scan for free slot in destination directory */
-        if (dir_scan_for_entry(fs, target_dir_cluster, "           ", &free_offset, &exists) != 0) {
-            printf("Error: directory scan failed for destination\n");
+        if (lookup_entry(fs, target_dir_cluster, src_short, taken, &taken_cluster, &taken_off)) {
+            printf("Error: '%s' already exists in '%s'\n", src, dest);
             return false;
         }
 
-        if (exists) {
-            printf("Error: unexpected duplicate during scan\n");
-            return false;
-        }
+        /* Find a free slot in the destination directory */
+        DirSlot at;
 
-        if (free_offset < 0) {
-            printf("Error: destination directory full\n");
+        if (!take_directory_slot(fs, target_dir_cluster, &at))
             return false;
-        }
 
         /* Write the copied entry into the destination directory */
-        if (fseek(fs->image, free_offset, SEEK_SET) != 0 ||
-            fwrite(entry, 1, 32, fs->image) != 32) {
+        if (!image_write(fs, (uint64_t)cluster_to_offset(fs, at.cluster) + at.offset, entry, 32)) {
             printf("Error: failed to write directory entry in destination\n");
+            give_back_directory_slot(fs, target_dir_cluster, &at);
             return false;
         }
 
         /* Mark old entry as free (0xE5 in first byte) */
-        if (fseek(fs->image, src_offset, SEEK_SET) == 0) {
-            unsigned char del = 0xE5;
-            fwrite(&del, 1, 1, fs->image);
-        }
+        unsigned char del = 0xE5;
+        image_write(fs, (uint64_t)src_offset, &del, 1);
 
-        fflush(fs->image);
+        dir_entry_removed(fs, fs->cwd_cluster, src_short);
+        dir_entry_added(fs, target_dir_cluster, src_short, &at, entry[11]);
+
+        fs_commit(fs);
         return true;
     }
 
@@ -1486,8 +3126,7 @@ bool fs_mv(FileSystem *fs, char *src, char *dest, struct OpenFiles *open_files,
     if (dest_offset < 0) {
         unsigned char entry[32];
 
-        if (fseek(fs->image, src_offset, SEEK_SET) != 0 ||
-            fread(entry, 1, 32, fs->image) != 32) {
+        if (!image_read(fs, (uint64_t)src_offset, entry, 32)) {
             printf("Error: failed to read source directory entry\n");
             return false;
         }
@@ -1495,13 +3134,14 @@ bool fs_mv(FileSystem *fs, char *src, char *dest, struct OpenFiles *open_files,
         /* Overwrite the name field with new short name */
         memcpy(entry, dest_short, 11);
 
-        if (fseek(fs->image, src_offset, SEEK_SET) != 0 ||
-            fwrite(entry, 1, 32, fs->image) != 32) {
+        if (!image_write(fs, (uint64_t)src_offset, entry, 32)) {
             printf("Error: failed to write renamed directory entry\n");
             return false;
         }
 
-        fflush(fs->image);
+        dir_entry_renamed(fs, fs->cwd_cluster, src_short, dest_short, entry[11]);
+
+        fs_commit(fs);
         return true;
     }
 
@@ -1537,14 +3177,16 @@ uint32_t getFileSize(char* filename, FileSystem* fs) {
 }
 
 /* readFile()  MULTICLUSTER SAFE
- * reads from filename in cwd , 0 on error or none read
+ * reads from the file ref was resolved to , 0 on error or none read
+ * clusters are located through the open file's extent map, so reading at any
+ * offset costs a binary search instead of a walk down the chain
  */
-uint32_t readFile(uint32_t start_offset, uint32_t size_to_read, char* filename, FileSystem* fs) {
+uint32_t readFile(uint32_t start_offset, uint32_t size_to_read, const DirEntryRef* ref, FileSystem* fs, OpenFile* file) {
 
-    if (!filename || !fs || !fs->image) 
+    if (!ref || !fs || !fs->image) 
         return 0;
 
-    uint32_t file_size = getFileSize(filename, fs);
+    uint32_t file_size = ref->size;
 
     if (start_offset >= file_size) 
         return 0;
@@ -1559,119 +3201,170 @@ uint32_t readFile(uint32_t start_offset, uint32_t size_to_read, char* filename,
     uint32_t cluster_size = bpb->bytes_per_sector * bpb->sectors_per_cluster;
 
 
-    uint32_t cur_cluster = getStartCluster(filename, fs);
+    uint32_t cur_cluster = ref->first_cluster;
 
     if (cur_cluster == 0) 
         return 0;
 
-    //Advance to the cluster that contains start_offset 
+    //open file's own map, or the chain cache when reading without one
+    const ExtentMap *extents = file_extents(fs, file, cur_cluster);
+
+    //cluster that contains start_offset 
     uint32_t cluster_index = start_offset / cluster_size;
     uint32_t offset_in_cluster = start_offset % cluster_size;
 
-    for (uint32_t i = 0; i < cluster_index; i++ ) {
-
-        uint32_t next = read_fat_entry(fs, cur_cluster);
-
-        if (next >= FAT32_EOC) {
-            return 0;
-        }
-
-        cur_cluster = next;
-    }
+    cur_cluster = extents ? extent_map_lookup(extents, cluster_index) : 0;
 
-    unsigned char *buf = (unsigned char*) malloc(cluster_size);
-
-    if (!buf) 
+    if (cur_cluster == 0) 
         return 0;
 
+    uint32_t first_index = cluster_index;
     uint32_t bytes_read = 0;
 
     while (bytes_read < to_read) {
 
-        long cluster_off = cluster_to_offset(fs, cur_cluster);
-
-        if (fseek(fs->image, cluster_off + offset_in_cluster, SEEK_SET) != 0) 
-            break;
-
         uint32_t can_read = cluster_size - offset_in_cluster;
 
         uint32_t want = to_read - bytes_read;
 
         uint32_t n = (want < can_read) ? want : can_read;
 
-        if (fread(buf, 1, n, fs->image) != n) 
-            break;
+        //load the clusters this read still needs, one vectored read per contiguous run
+        if ((cluster_index - first_index) % PREFETCH_WINDOW == 0)
+            prefetch_chain(fs, extents, cluster_index, (offset_in_cluster + (to_read - bytes_read) + cluster_size - 1) / cluster_size);
 
+        //print straight out of the buffer cache (or the mapping), no copy
+        const unsigned char *src = pin_cluster(fs, cur_cluster);
+
+        if (!src) 
+            break;
 
-        size_t written = fwrite(buf, 1, n, stdout);
+        size_t written = fwrite(src + offset_in_cluster, 1, n, stdout);
         (void) written; 
 
+        unpin_cluster(fs, cur_cluster);
+
         bytes_read += n;
 
         offset_in_cluster = 0;
 
         if (bytes_read < to_read) {
 
-            uint32_t next = read_fat_entry(fs, cur_cluster);
+            cur_cluster = extent_map_lookup(extents, ++cluster_index);
 
-            if (next >= FAT32_EOC) 
+            if (cur_cluster == 0) 
                 break;
-
-            cur_cluster = next;
         }
     }
 
-    free(buf);
+    //streaming through an open file, have the next clusters on their way
+    if (file)
+        file_readahead(fs, file, extents, start_offset, bytes_read);
+
     return bytes_read;
 }
 
 
-/* writeToFile() MULTICLUSTER SAFE
- * writes the bytes to filename
- * returns the number of bytes written or 0 on error or none.
+/* exportFile()  MULTICLUSTER SAFE
+ * sends bytes of the file ref was resolved to straight to the host descriptor out_fd,
+ * 0 on error or none sent. each run of consecutive clusters is one
+ * blockdev_copy_out, so the data is copied by the kernel and never passes
+ * through the shell
  */
-uint32_t writeToFile(const char* filename, const char* bytes_to_write, uint32_t start_offset, FileSystem* fs , OpenFile* file ) {
+uint32_t exportFile(uint32_t start_offset, uint32_t size_to_export, const DirEntryRef* ref, int out_fd, FileSystem* fs, OpenFile* file) {
 
-    size_t write_len = strlen(bytes_to_write);
+    if (!ref || !fs || !fs->image) 
+        return 0;
 
-    if (write_len == 0)
+    uint32_t file_size = ref->size;
+
+    if (start_offset >= file_size) 
         return 0;
 
-    char short_name[11];
-    build_short_name(short_name, filename);
+    uint32_t remaining = file_size - start_offset;
+    uint32_t to_export = (size_to_export < remaining) ? size_to_export : remaining;
+
+    if (to_export == 0) 
+        return 0;
+
+    const Fat32BootSector *bpb = &fs->bpb;
+    uint32_t cluster_size = bpb->bytes_per_sector * bpb->sectors_per_cluster;
 
-    uint32_t start_cluster = 0;
-    uint8_t attr = 0;
+    uint32_t cur_cluster = ref->first_cluster;
 
+    if (cur_cluster == 0) 
+        return 0;
 
-    uint32_t entry_cluster = 0;
-    uint32_t cluster_off = 0;
+    const ExtentMap *extents = file_extents(fs, file, cur_cluster);
 
-    unsigned char* entry_copy = getEntry( short_name, fs, &entry_cluster, &cluster_off);
+    if (!extents)
+        return 0;
 
-    if (!entry_copy) {
+    //the kernel copies from the image, writes still in the buffer cache have to be there first
+    if (!buf_cache_flush_data(&fs->buf_cache)) {
+        printf("Error: failed to write back cached clusters\n");
         return 0;
     }
 
-    attr = entry_copy[11];
-    start_cluster = ((uint32_t)entry_copy[21] << 24) | ((uint32_t)entry_copy[20] << 16) |
-                    ((uint32_t)entry_copy[27] << 8) | (uint32_t)entry_copy[26]; //start cluster
+    uint32_t cluster_index = start_offset / cluster_size;
+    uint32_t offset_in_cluster = start_offset % cluster_size;
+    uint32_t bytes_sent = 0;
+
+    while (bytes_sent < to_export) {
 
-    long entry_offset = cluster_to_offset(fs, entry_cluster) + (long)cluster_off;
+        uint32_t start = extent_map_lookup(extents, cluster_index);
 
-    free(entry_copy);
+        if (start == 0) 
+            break;
 
-    if (entry_offset < 0){
+        //clusters still wanted, and how many of them follow 'start' on disk
+        uint64_t want = ((uint64_t)offset_in_cluster + (to_export - bytes_sent) + cluster_size - 1) / cluster_size;
+        uint32_t run = 1;
 
-        return 0;
+        while (run < want && extent_map_lookup(extents, cluster_index + run) == start + run)
+            run++;
+
+        uint64_t n = (uint64_t)run * cluster_size - offset_in_cluster;
+
+        if (n > to_export - bytes_sent)
+            n = to_export - bytes_sent;
+
+        if (!blockdev_copy_out(fs->image, (uint64_t)cluster_to_offset(fs, start) + offset_in_cluster, (size_t)n, out_fd)) {
+            printf("Error: failed to export cluster %u\n", start);
+            break;
+        }
+
+        bytes_sent += (uint32_t)n;
+        cluster_index += run;
+        offset_in_cluster = 0;
     }
 
-    if (attr & 0x10){
+    return bytes_sent;
+}
+
+
+/* writeToFile() MULTICLUSTER SAFE
+ * writes the bytes to the file ref was resolved to, and rewrites its
+ * directory entry in place
+ * returns the number of bytes written or 0 on error or none.
+ */
+uint32_t writeToFile(DirEntryRef* ref, const char* bytes_to_write, uint32_t start_offset, FileSystem* fs , OpenFile* file ) {
+
+    size_t write_len = strlen(bytes_to_write);
+
+    if (write_len == 0 || !ref)
+        return 0;
+
+    uint32_t start_cluster = ref->first_cluster;
+
+    long entry_offset = cluster_to_offset(fs, ref->entry_cluster) + (long)ref->entry_offset;
+
+    if (ref->attr & 0x10){
   //id directory
         return 0;
     }
 
-    uint32_t old_size = getFileSize((char*)filename, fs);
+    uint32_t old_size = ref->size;
 
     //bound to EOF
     uint32_t write_offset = (start_offset > old_size) ? old_size : start_offset;
@@ -1698,24 +3391,16 @@ uint32_t writeToFile(const char* filename, const char* bytes_to_write, uint32_t
 
     file->startCluster = cur_cluster; //set new start cluster for id and usage
 
-    //get cluster range
-    uint32_t cluster_count = 1;
-    uint32_t last_cluster = cur_cluster;
-
-    while (true) {
-
-        uint32_t next = read_fat_entry(fs, last_cluster);
+    //get cluster range from the extent map, built once per open file
+    ExtentMap *extents = &file->extents;
 
-        if (next >= FAT32_EOC) 
-            break;
-
-        last_cluster = next;
-        cluster_count++;
-
-        if (cluster_count > fs->total_clusters + 7) 
-            break;
+    if (!file_extents(fs, file, cur_cluster)) {
+        return 0;
     }
 
+    uint32_t cluster_count = extents->total_clusters;
+    uint32_t last_cluster = extent_map_last(extents);
+
 
     //calc cluster size increaase needed?
     uint32_t final_needed_size = write_offset + (uint32_t)write_len;
@@ -1725,40 +3410,21 @@ uint32_t writeToFile(const char* filename, const char* bytes_to_write, uint32_t
 
         uint32_t need = required_clusters - cluster_count;
 
-        for (uint32_t i = 0; i < need; i++ ) {
-
-            uint32_t new_cluster = allocate_cluster(fs);
-
-            if (new_cluster == 0) {
-                return 0 ;
-
-            }
-
-
-            write_fat_entry(fs, last_cluster, new_cluster);
-
-            write_fat_entry(fs, new_cluster, FAT32_EOC);
-
-            last_cluster = new_cluster;
-            cluster_count++;
+        //one request for the whole growth so it lands in as few runs as possible
+        if (allocate_clusters(fs, last_cluster, need, extents) != need) {
+            return 0;
         }
     }
 
     //find cluster that contains write_offset
-    uint32_t target_cluster = start_cluster;
-
-    uint32_t skip_clusters = write_offset / cluster_size;
+    uint32_t cluster_index = write_offset / cluster_size;
 
     uint32_t off_in_cluster = write_offset % cluster_size;
 
-    for (uint32_t i = 0; i < skip_clusters; i++ ) {
+    uint32_t target_cluster = extent_map_lookup(extents, cluster_index);
 
-        uint32_t next = read_fat_entry(fs, target_cluster);
-
-        if (next >= FAT32_EOC)
-            break;
-
-        target_cluster = next;
+    if (target_cluster == 0) {
+        return 0;
     }
 
     const char *src = bytes_to_write;
@@ -1767,23 +3433,12 @@ uint32_t writeToFile(const char* filename, const char* bytes_to_write, uint32_t
 
     uint32_t written = 0;
 
-    unsigned char *buf = (unsigned char*) malloc(cluster_size);
-
-    if (!buf) { 
-        return 0;
-    }
-
     while (remaining > 0) {
 
-        long cluster_off = cluster_to_offset(fs, target_cluster);
-
-        if (fseek(fs->image, cluster_off + off_in_cluster, SEEK_SET) != 0) 
-            break;
-
         uint32_t can = cluster_size - off_in_cluster;
         uint32_t to_write = (remaining < can) ? remaining : can;
 
-        if (fwrite(src, 1, to_write, fs->image) != to_write) 
+        if (!buf_cache_write(&fs->buf_cache, target_cluster, off_in_cluster, src, to_write)) 
             break;
 
         written += to_write;
@@ -1794,25 +3449,17 @@ uint32_t writeToFile(const char* filename, const char* bytes_to_write, uint32_t
 
         if (remaining > 0) {
 
-            uint32_t next = read_fat_entry(fs, target_cluster);
+            target_cluster = extent_map_lookup(extents, ++cluster_index);
 
-            if (next >= FAT32_EOC) 
+            if (target_cluster == 0) 
                 break;
-
-            target_cluster = next;
         }
     }
 
-    free(buf);
-
     // update directory entry, first cluster (if changed) and file size 
     unsigned char entry[32];
     
-    if (fseek(fs->image, entry_offset, SEEK_SET) != 0) {
-
-        return written;
-    }
-    if (fread(entry, 1, 32, fs->image) != 32) {
+    if (!image_read(fs, (uint64_t)entry_offset, entry, 32)) {
 
         return written;
     }
@@ -1829,11 +3476,13 @@ uint32_t writeToFile(const char* filename, const char* bytes_to_write, uint32_t
     entry[30] = (unsigned char)((final_size >> 16) & 0xFF);
     entry[31] = (unsigned char)((final_size >> 24) & 0xFF);
 
-    if (fseek(fs->image, entry_offset, SEEK_SET) == 0) {
-        fwrite(entry, 1, 32, fs->image);
-    }
+    image_write(fs, (uint64_t)entry_offset, entry, 32);
+
+    ref->first_cluster = start_cluster;
+    ref->size = final_size;
+    remember_ref(fs, ref);
 
-    fflush(fs->image);
+    fs_commit(fs);
     return written;
 }
 
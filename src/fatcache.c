@@ -0,0 +1,299 @@
+#include "fatcache.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * fat_cache_init()
+ * Allocates the sector buffer and state table. Nothing is read until an
+ * entry is first touched.
+ */
+bool fat_cache_init(FatCache *cache, uint32_t num_sectors, uint32_t sector_size, long base_offset,
+                    uint32_t num_copies, long copy_stride) {
+
+    memset(cache, 0, sizeof(*cache));
+
+    if (num_sectors == 0 || sector_size == 0)
+        return false;
+
+    cache->data = (unsigned char *) malloc((size_t)num_sectors * sector_size);
+    cache->state = (uint8_t *) calloc(num_sectors, 1);
+
+    if (!cache->data || !cache->state) {
+        fat_cache_free(cache);
+        return false;
+    }
+
+    cache->num_sectors = num_sectors;
+    cache->sector_size = sector_size;
+    cache->base_offset = base_offset;
+    cache->num_copies = (num_copies == 0) ? 1 : num_copies;
+    cache->copy_stride = copy_stride;
+
+    return true;
+}
+
+void fat_cache_free(FatCache *cache) {
+
+    free(cache->data);
+    free(cache->state);
+
+    cache->data = NULL;
+    cache->state = NULL;
+    cache->num_sectors = 0;
+    cache->dirty_count = 0;
+    cache->logged_count = 0;
+}
+
+/*
+ * load_sectors()
+ * Makes sure 'sector' is in memory. A miss reads the sector together with
+ * the following not yet loaded sectors (up to FAT_CACHE_READAHEAD) in one go,
+ * since chains mostly run forward through the FAT.
+ */
+static bool load_sectors(FatCache *cache, BlockDevice *image, uint32_t sector) {
+
+    if (cache->state[sector] & FAT_SECTOR_LOADED)
+        return true;
+
+    uint32_t count = 1;
+
+    while (count < FAT_CACHE_READAHEAD &&
+           sector + count < cache->num_sectors &&
+           !(cache->state[sector + count] & FAT_SECTOR_LOADED)) {
+        count++;
+    }
+
+    long offset = cache->base_offset + (long)sector * cache->sector_size;
+    size_t bytes = (size_t)count * cache->sector_size;
+
+    if (!blockdev_read(image, (uint64_t)offset, cache->data + (size_t)sector * cache->sector_size, bytes))
+        return false;
+
+    for (uint32_t i = 0; i < count; i++)
+        cache->state[sector + i] |= FAT_SECTOR_LOADED;
+
+    return true;
+}
+
+bool fat_cache_read(FatCache *cache, BlockDevice *image, uint32_t index, uint32_t *value) {
+
+    uint64_t sector = ((uint64_t)index * 4) / cache->sector_size;
+
+    if (sector >= cache->num_sectors || !load_sectors(cache, image, sector))
+        return false;
+
+    const unsigned char *p = cache->data + (size_t)index * 4;
+
+    *value = (uint32_t)p[0]
+           | ((uint32_t)p[1] << 8)
+           | ((uint32_t)p[2] << 16)
+           | ((uint32_t)p[3] << 24);
+
+    return true;
+}
+
+bool fat_cache_write(FatCache *cache, BlockDevice *image, uint32_t index, uint32_t value) {
+
+    uint64_t sector = ((uint64_t)index * 4) / cache->sector_size;
+
+    //the rest of the sector has to be valid before it can be written back
+    if (sector >= cache->num_sectors || !load_sectors(cache, image, sector))
+        return false;
+
+    unsigned char *p = cache->data + (size_t)index * 4;
+
+    p[0] = (unsigned char)(value & 0xFF);
+    p[1] = (unsigned char)((value >> 8) & 0xFF);
+    p[2] = (unsigned char)((value >> 16) & 0xFF);
+    p[3] = (unsigned char)((value >> 24) & 0xFF);
+
+    if (!(cache->state[sector] & FAT_SECTOR_DIRTY)) {
+        cache->state[sector] |= FAT_SECTOR_DIRTY;
+        cache->dirty_count++;
+    }
+
+    return true;
+}
+
+const unsigned char* fat_cache_sectors(FatCache *cache, BlockDevice *image, uint32_t first, uint32_t count) {
+
+    if ((uint64_t)first + count > cache->num_sectors)
+        return NULL;
+
+    for (uint32_t s = first; s < first + count; s++) {
+        if (!load_sectors(cache, image, s))
+            return NULL;
+    }
+
+    return cache->data + (size_t)first * cache->sector_size;
+}
+
+/*
+ * fat_cache_clear_range()
+ * Frees a run of consecutive entries with one memset per FAT sector instead
+ * of one fat_cache_write() per entry.
+ */
+bool fat_cache_clear_range(FatCache *cache, BlockDevice *image, uint32_t first, uint32_t count) {
+
+    uint32_t per_sector = cache->sector_size / 4;
+    uint64_t end = (uint64_t)first + count;
+
+    if (end > (uint64_t)cache->num_sectors * per_sector)
+        return false;
+
+    uint64_t index = first;
+
+    while (index < end) {
+
+        uint32_t sector = (uint32_t)(index / per_sector);
+        uint64_t sector_end = (uint64_t)(sector + 1) * per_sector;
+        uint64_t stop = (end < sector_end) ? end : sector_end;
+
+        if (!load_sectors(cache, image, sector))
+            return false;
+
+        memset(cache->data + index * 4, 0, (size_t)(stop - index) * 4);
+
+        if (!(cache->state[sector] & FAT_SECTOR_DIRTY)) {
+            cache->state[sector] |= FAT_SECTOR_DIRTY;
+            cache->dirty_count++;
+        }
+
+        index = stop;
+    }
+
+    return true;
+}
+
+/*
+ * collect_runs()
+ * Turns each run of consecutive sectors with any of the 'flags' into one
+ * request per FAT copy, ordered copy by copy. Returns the number of requests
+ * and the array in *out (to be freed), or 0 and NULL when there is nothing.
+ */
+static uint32_t collect_runs(FatCache *cache, uint8_t flags, IoRequest **out) {
+
+    uint32_t runs = 0;
+
+    *out = NULL;
+
+    for (uint32_t s = 0; s < cache->num_sectors; s++) {
+        if ((cache->state[s] & flags) && (s == 0 || !(cache->state[s - 1] & flags)))
+            runs++;
+    }
+
+    if (runs == 0)
+        return 0;
+
+    IoRequest *reqs = (IoRequest *) malloc((size_t)runs * cache->num_copies * sizeof(IoRequest));
+
+    if (!reqs)
+        return 0;
+
+    uint32_t n = 0;
+
+    for (uint32_t copy = 0; copy < cache->num_copies; copy++) {
+
+        long base = cache->base_offset + (long)copy * cache->copy_stride;
+        uint32_t s = 0;
+
+        while (s < cache->num_sectors) {
+
+            if (!(cache->state[s] & flags)) {
+                s++;
+                continue;
+            }
+
+            uint32_t run = 1;
+
+            while (s + run < cache->num_sectors && (cache->state[s + run] & flags))
+                run++;
+
+            reqs[n].offset = (uint64_t)(base + (long)s * cache->sector_size);
+            reqs[n].buf = cache->data + (size_t)s * cache->sector_size;
+            reqs[n].len = run * cache->sector_size;
+            reqs[n].write = true;
+            n++;
+
+            s += run;
+        }
+    }
+
+    *out = reqs;
+
+    return n;
+}
+
+/*
+ * fat_cache_flush()
+ * Hands the runs of every copy to the device as a single batch. Done
+ * synchronously the writes stay sequential, on an asynchronous device they
+ * are all in flight together. Sectors stay loaded after a flush and only
+ * lose their flags once every copy has them.
+ */
+bool fat_cache_flush(FatCache *cache, BlockDevice *image) {
+
+    if (cache->dirty_count == 0 && cache->logged_count == 0)
+        return true;
+
+    IoRequest *reqs;
+    uint32_t n = collect_runs(cache, FAT_SECTOR_DIRTY | FAT_SECTOR_LOGGED, &reqs);
+
+    if (!reqs)
+        return false;
+
+    bool ok = blockdev_submit(image, reqs, n);
+
+    free(reqs);
+
+    //on failure everything stays dirty so a later flush rewrites all copies
+    if (!ok)
+        return false;
+
+    for (uint32_t s = 0; s < cache->num_sectors; s++)
+        cache->state[s] &= (uint8_t)~(FAT_SECTOR_DIRTY | FAT_SECTOR_LOGGED);
+
+    cache->dirty_count = 0;
+    cache->logged_count = 0;
+
+    return true;
+}
+
+bool fat_cache_log(FatCache *cache, JournalTxn *txn) {
+
+    if (cache->dirty_count == 0)
+        return true;
+
+    IoRequest *reqs;
+    uint32_t n = collect_runs(cache, FAT_SECTOR_DIRTY, &reqs);
+
+    if (!reqs)
+        return false;
+
+    bool ok = true;
+
+    for (uint32_t i = 0; i < n && ok; i++)
+        ok = journal_txn_add(txn, reqs[i].offset, reqs[i].buf, reqs[i].len);
+
+    free(reqs);
+
+    return ok;
+}
+
+void fat_cache_logged(FatCache *cache) {
+
+    for (uint32_t s = 0; s < cache->num_sectors; s++) {
+
+        if (!(cache->state[s] & FAT_SECTOR_DIRTY))
+            continue;
+
+        cache->state[s] &= (uint8_t)~FAT_SECTOR_DIRTY;
+
+        if (!(cache->state[s] & FAT_SECTOR_LOGGED)) {
+            cache->state[s] |= FAT_SECTOR_LOGGED;
+            cache->logged_count++;
+        }
+    }
+
+    cache->dirty_count = 0;
+}
@@ -0,0 +1,204 @@
+#include "fatscan.h"
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT_SCAN_X86 1
+#endif
+
+#define FAT_ENTRY_MASK 0x0FFFFFFF
+
+typedef uint32_t (*first_free_fn)(const unsigned char *entries, uint32_t count);
+typedef void (*used_bits_fn)(const unsigned char *entries, uint32_t count, uint64_t *words);
+
+static first_free_fn first_free_impl = NULL;
+static used_bits_fn used_bits_impl = NULL;
+static const char *kernel_name = "scalar";
+
+static uint32_t entry_at(const unsigned char *entries, uint32_t i) {
+
+    const unsigned char *p = entries + (size_t)i * 4;
+
+    return (uint32_t)p[0]
+         | ((uint32_t)p[1] << 8)
+         | ((uint32_t)p[2] << 16)
+         | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Scalar kernels, also used for the tails the vector loops leave behind
+ */
+static uint32_t first_free_scalar(const unsigned char *entries, uint32_t count) {
+
+    for (uint32_t i = 0; i < count; i++) {
+        if ((entry_at(entries, i) & FAT_ENTRY_MASK) == 0)
+            return i;
+    }
+
+    return count;
+}
+
+static void used_bits_scalar(const unsigned char *entries, uint32_t count, uint64_t *words) {
+
+    for (uint32_t i = 0; i < count; i++) {
+        if ((entry_at(entries, i) & FAT_ENTRY_MASK) != 0)
+            words[i / 64] |= 1ULL << (i % 64);
+    }
+}
+
+#ifdef FAT_SCAN_X86
+
+/*
+ * SSE2 kernels: 4 entries per compare. movemask gives one bit per entry that
+ * compared equal to zero after masking, i.e. one bit per free entry.
+ */
+__attribute__((target("sse2")))
+static uint32_t first_free_sse2(const unsigned char *entries, uint32_t count) {
+
+    const __m128i mask = _mm_set1_epi32(FAT_ENTRY_MASK);
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+
+        __m128i v = _mm_loadu_si128((const __m128i *)(entries + (size_t)i * 4));
+        __m128i eq = _mm_cmpeq_epi32(_mm_and_si128(v, mask), zero);
+        int bits = _mm_movemask_ps(_mm_castsi128_ps(eq));
+
+        if (bits != 0)
+            return i + (uint32_t)__builtin_ctz((unsigned)bits);
+    }
+
+    return i + first_free_scalar(entries + (size_t)i * 4, count - i);
+}
+
+__attribute__((target("sse2")))
+static void used_bits_sse2(const unsigned char *entries, uint32_t count, uint64_t *words) {
+
+    const __m128i mask = _mm_set1_epi32(FAT_ENTRY_MASK);
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+
+    for (; i + 64 <= count; i += 64) {
+
+        uint64_t free_bits = 0;
+
+        for (uint32_t j = 0; j < 64; j += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(entries + (size_t)(i + j) * 4));
+            __m128i eq = _mm_cmpeq_epi32(_mm_and_si128(v, mask), zero);
+            free_bits |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(eq)) << j;
+        }
+
+        words[i / 64] |= ~free_bits;
+    }
+
+    //tail starts on a word boundary, so the scalar kernel's word indexing lines up
+    used_bits_scalar(entries + (size_t)i * 4, count - i, words + i / 64);
+}
+
+/*
+ * AVX2 kernels: 8 entries per compare, four compares folded together per
+ * iteration so the branch is taken once per 32 entries.
+ */
+__attribute__((target("avx2")))
+static uint32_t first_free_avx2(const unsigned char *entries, uint32_t count) {
+
+    const __m256i mask = _mm256_set1_epi32(FAT_ENTRY_MASK);
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+
+        const unsigned char *p = entries + (size_t)i * 4;
+
+        __m256i e0 = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)(p)), mask), zero);
+        __m256i e1 = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)(p + 32)), mask), zero);
+        __m256i e2 = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)(p + 64)), mask), zero);
+        __m256i e3 = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)(p + 96)), mask), zero);
+
+        __m256i any = _mm256_or_si256(_mm256_or_si256(e0, e1), _mm256_or_si256(e2, e3));
+
+        if (_mm256_testz_si256(any, any))
+            continue;
+
+        uint32_t bits = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(e0))
+                      | ((uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(e1)) << 8)
+                      | ((uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(e2)) << 16)
+                      | ((uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(e3)) << 24);
+
+        return i + (uint32_t)__builtin_ctz(bits);
+    }
+
+    return i + first_free_scalar(entries + (size_t)i * 4, count - i);
+}
+
+__attribute__((target("avx2")))
+static void used_bits_avx2(const unsigned char *entries, uint32_t count, uint64_t *words) {
+
+    const __m256i mask = _mm256_set1_epi32(FAT_ENTRY_MASK);
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t i = 0;
+
+    for (; i + 64 <= count; i += 64) {
+
+        uint64_t free_bits = 0;
+
+        for (uint32_t j = 0; j < 64; j += 8) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(entries + (size_t)(i + j) * 4));
+            __m256i eq = _mm256_cmpeq_epi32(_mm256_and_si256(v, mask), zero);
+            free_bits |= (uint64_t)(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eq)) << j;
+        }
+
+        words[i / 64] |= ~free_bits;
+    }
+
+    used_bits_scalar(entries + (size_t)i * 4, count - i, words + i / 64);
+}
+
+#endif
+
+void fat_scan_init(void) {
+
+    first_free_impl = first_free_scalar;
+    used_bits_impl = used_bits_scalar;
+    kernel_name = "scalar";
+
+#ifdef FAT_SCAN_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        first_free_impl = first_free_avx2;
+        used_bits_impl = used_bits_avx2;
+        kernel_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        first_free_impl = first_free_sse2;
+        used_bits_impl = used_bits_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+}
+
+const char* fat_scan_kernel(void) {
+
+    if (!first_free_impl)
+        fat_scan_init();
+
+    return kernel_name;
+}
+
+uint32_t fat_scan_first_free(const unsigned char *entries, uint32_t count) {
+
+    if (!first_free_impl)
+        fat_scan_init();
+
+    return first_free_impl(entries, count);
+}
+
+void fat_scan_used_bits(const unsigned char *entries, uint32_t count, uint64_t *words) {
+
+    if (!used_bits_impl)
+        fat_scan_init();
+
+    used_bits_impl(entries, count, words);
+}
@@ -0,0 +1,126 @@
+#define _POSIX_C_SOURCE 200809L
+#include "fatstats.h"
+#include "fatscan.h"
+#include <pthread.h>
+#include <string.h>
+#include <stddef.h>
+
+#define FAT_STATS_MAX_THREADS 64
+
+typedef struct {
+    const unsigned char *fat; // entry 0 of the FAT
+    uint32_t first; // first entry of this worker's range, multiple of 64
+    uint32_t count; // entries in the range
+    uint32_t end; // end of the whole scan, bounds for link checks
+    uint64_t *words; // bitmap words, the worker writes words [first / 64, ...)
+    bool want_stats;
+    FatStats stats; // this range's counters
+} ScanRange;
+
+/*
+ * scan_range()
+ * Worker body. Bitmap bits come from the vectorized kernel, the counters need
+ * the entry values so they are a separate plain loop, skipped when not wanted.
+ */
+static void* scan_range(void *arg) {
+
+    ScanRange *r = (ScanRange *) arg;
+
+    fat_scan_used_bits(r->fat + (size_t)r->first * 4, r->count, r->words + r->first / 64);
+
+    if (!r->want_stats)
+        return NULL;
+
+    uint32_t c = (r->first < 2) ? 2 : r->first;
+    uint32_t stop = r->first + r->count;
+
+    for (; c < stop; c++) {
+
+        const unsigned char *p = r->fat + (size_t)c * 4;
+        uint32_t v = ((uint32_t)p[0]
+                   | ((uint32_t)p[1] << 8)
+                   | ((uint32_t)p[2] << 16)
+                   | ((uint32_t)p[3] << 24)) & 0x0FFFFFFF;
+
+        if (v == 0) {
+            r->stats.free_clusters++;
+            continue;
+        }
+
+        r->stats.used_clusters++;
+
+        if (v == 0x0FFFFFF7)
+            r->stats.bad_clusters++;
+        else if (v >= 0x0FFFFFF8)
+            r->stats.chains++;
+        else if (v < 2 || v >= r->end)
+            r->stats.invalid_links++;
+        else if (v != c + 1)
+            r->stats.fragments++;
+    }
+
+    return NULL;
+}
+
+void fat_stats_scan(const unsigned char *fat, uint32_t end, uint64_t *words, FatStats *stats, unsigned threads) {
+
+    if (threads == 0)
+        threads = 1;
+    if (threads > FAT_STATS_MAX_THREADS)
+        threads = FAT_STATS_MAX_THREADS;
+
+    //ranges are whole bitmap words so no two workers write the same word
+    uint32_t total_words = (end + 63) / 64;
+    uint32_t words_per = (total_words + threads - 1) / threads;
+
+    if (words_per == 0)
+        words_per = 1;
+
+    ScanRange ranges[FAT_STATS_MAX_THREADS];
+    pthread_t tids[FAT_STATS_MAX_THREADS];
+    bool started[FAT_STATS_MAX_THREADS];
+    unsigned n = 0;
+
+    for (uint32_t w = 0; w < total_words && n < threads; w += words_per, n++) {
+
+        ScanRange *r = &ranges[n];
+
+        memset(r, 0, sizeof(*r));
+        r->fat = fat;
+        r->first = w * 64;
+        r->count = words_per * 64;
+        if ((uint64_t)r->first + r->count > end)
+            r->count = end - r->first;
+        r->end = end;
+        r->words = words;
+        r->want_stats = (stats != NULL);
+    }
+
+    //the calling thread takes the first range itself
+    for (unsigned i = 1; i < n; i++)
+        started[i] = (pthread_create(&tids[i], NULL, scan_range, &ranges[i]) == 0);
+
+    if (n > 0)
+        scan_range(&ranges[0]);
+
+    for (unsigned i = 1; i < n; i++) {
+        if (started[i])
+            pthread_join(tids[i], NULL);
+        else
+            scan_range(&ranges[i]); //could not spawn, do it here
+    }
+
+    if (!stats)
+        return;
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (unsigned i = 0; i < n; i++) {
+        stats->free_clusters += ranges[i].stats.free_clusters;
+        stats->used_clusters += ranges[i].stats.used_clusters;
+        stats->bad_clusters += ranges[i].stats.bad_clusters;
+        stats->chains += ranges[i].stats.chains;
+        stats->fragments += ranges[i].stats.fragments;
+        stats->invalid_links += ranges[i].stats.invalid_links;
+    }
+}
@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200809L // fileno
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,18 +6,118 @@
 #include "fat32.h"
 #include "utils.h"
 
+//s is a decimal number and nothing else, strtoul alone reads "abc" as 0
+static bool parse_number(const char *s, unsigned long *out) {
+
+    char *endptr = NULL;
+
+    if (s[0] < '0' || s[0] > '9')
+        return false;
+
+    *out = strtoul(s, &endptr, 10);
+
+    return *endptr == '\0';
+}
+
 /*
  * Main interactive shell for FAT32 project.
  *
  */
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <fat32_image>\n", argv[0]);
+
+    MountOptions options;
+    mount_options_default(&options);
+
+    const char *image_path = NULL;
+    bool bad_args = false;
+
+    for (int i = 1; i < argc; i++) {
+
+        if (strncmp(argv[i], "--scan-threads=", 15) == 0) {
+            /*
+             * --scan-threads=N
+             * Scan the whole FAT at mount on N threads and report chain
+             * statistics in info.
+             */
+            unsigned long n;
+
+            if (parse_number(argv[i] + 15, &n))
+                options.scan_threads = (unsigned) n;
+            else
+                bad_args = true;
+        }
+        else if (strncmp(argv[i], "--device=", 9) == 0) {
+            /*
+             * --device=pread|mmap|memory|direct
+             * Backend used for all image I/O, see blockdev.h.
+             */
+            if (!blockdev_kind_from_name(argv[i] + 9, &options.device))
+                bad_args = true;
+        }
+        else if (strncmp(argv[i], "--cache-kb=", 11) == 0) {
+            /*
+             * --cache-kb=N
+             * Memory budget of the cluster buffer cache.
+             */
+            unsigned long kb;
+
+            if (parse_number(argv[i] + 11, &kb))
+                options.cache_bytes = (size_t) kb * 1024;
+            else
+                bad_args = true;
+        }
+        else if (strcmp(argv[i], "--mmap") == 0) {
+            options.device = BLOCKDEV_MMAP; //same as --device=mmap
+        }
+        else if (strcmp(argv[i], "--journal") == 0) {
+            /*
+             * --journal
+             * Log metadata to <image>.jnl, see journal.h.
+             */
+            options.journal = true;
+        }
+        else if (strncmp(argv[i], "--durability=", 13) == 0) {
+            /*
+             * --durability=none|close|periodic|strict
+             * When changes are fsynced, see Durability in fat32.h.
+             */
+            if (!durability_from_name(argv[i] + 13, &options.durability))
+                bad_args = true;
+        }
+        else if (strncmp(argv[i], "--sync-interval=", 16) == 0) {
+            /*
+             * --sync-interval=SECONDS
+             * fsync period of --durability=periodic.
+             */
+            unsigned long seconds;
+
+            if (parse_number(argv[i] + 16, &seconds))
+                options.sync_interval = (unsigned) seconds;
+            else
+                bad_args = true;
+        }
+        else if (strcmp(argv[i], "--io-uring") == 0) {
+            /*
+             * --io-uring
+             * Batch prefetches and flushes through io_uring (pread backend).
+             */
+            options.async_io = true;
+        }
+        else if (image_path == NULL && argv[i][0] != '-') {
+            image_path = argv[i];
+        }
+        else {
+            bad_args = true;
+        }
+    }
+
+    if (bad_args || image_path == NULL) {
+        fprintf(stderr, "Usage: %s [--scan-threads=N] [--device=pread|mmap|memory|direct] [--cache-kb=N] [--io-uring] [--journal] [--durability=none|close|periodic|strict] [--sync-interval=SECONDS] <fat32_image>\n", argv[0]);
         return EXIT_FAILURE;
     }
 
     FileSystem fs;
-    if (!fs_mount(&fs, argv[1])) {
+    if (!fs_mount_with(&fs, image_path, &options)) {
         return EXIT_FAILURE;
     }
 
@@ -96,6 +197,38 @@ int main(int argc, char *argv[]) {
                     }
                 }
             }
+            else if (strcmp(cmd, "sync") == 0) {
+                /*
+                * sync
+                * Write everything cached back and fsync the image.
+                */
+                if (tokens->size != 1)
+                    printf("Error: usage: sync\n");
+                else if (!fs_sync(&fs))
+                    printf("Error: cannot sync image\n");
+            }
+            else if (strcmp(cmd, "durability") == 0) {
+                /*
+                * durability [none|close|periodic|strict] [SECONDS]
+                * Show or change when changes are fsynced.
+                */
+                Durability mode;
+                unsigned long seconds = 0;
+
+                if (tokens->size == 1) {
+                    if (fs.durability == DURABILITY_PERIODIC)
+                        printf("durability: periodic (%u s)\n", fs.sync_interval);
+                    else
+                        printf("durability: %s\n", durability_name(fs.durability));
+                }
+                else if (tokens->size > 3 || !durability_from_name(tokens->items[1], &mode) ||
+                         (tokens->size == 3 && !parse_number(tokens->items[2], &seconds))) {
+                    printf("Error: usage: durability [none|close|periodic|strict] [SECONDS]\n");
+                }
+                else if (!fs_set_durability(&fs, mode, (unsigned) seconds)) {
+                    printf("Error: cannot sync image\n");
+                }
+            }
             else if (strcmp(cmd, "exit") == 0) {
                 /*
                 * exit
@@ -116,7 +249,9 @@ int main(int argc, char *argv[]) {
                 }
                 else {
 
-                    if( checkExists( tokens->items[1] , &fs ) == -1  || checkIsFile( tokens->items[1] , &fs ) == -1 ) { //file/directory doesnt exist
+                    DirEntryRef ref;
+
+                    if( !fs_resolve( &fs , tokens->items[1] , &ref ) || ( ref.attr & 0x10 ) ) { //file/directory doesnt exist
                         printf("Error: file does not exist\n" );
                     }
                     else {
@@ -125,7 +260,7 @@ int main(int argc, char *argv[]) {
 
                         CurrentDirectory direc = getcwd( &fs );
 
-                        if( openFile( &openFiles , tokens->items[1] , getReadWrite( tokens ) , getStartCluster( tokens->items[1] , &fs ) , &direc ) == -1 ) {
+                        if( openFile( &openFiles , tokens->items[1] , getReadWrite( tokens ) , ref.first_cluster , &direc ) == -1 ) {
                             printf("Error: cannot open file, likely already open.\n");
                         }
                         free( direc.cwd );
@@ -140,13 +275,15 @@ int main(int argc, char *argv[]) {
                 }
                 else {
 
-                    if( checkExists( tokens->items[1] , &fs ) == -1 || checkIsFile( tokens->items[1] , &fs ) == -1 ) {
+                    DirEntryRef ref;
+
+                    if( !fs_resolve( &fs , tokens->items[1] , &ref ) || ( ref.attr & 0x10 ) ) {
                         printf("Error: file does not exist - maybe it is a directory?\n");
                     }
                     else {
                         //file exists and is a fikle indeed check if open?
 
-                        uint32_t startCluster = getStartCluster( tokens->items[1] , &fs );
+                        uint32_t startCluster = ref.first_cluster;
 
                         if( checkIsOpen(  &openFiles , cwd.cwd , tokens->items[1] ) == 0 ) { //file not open , error
                             printf("Error: file is not open.\n");
@@ -155,6 +292,8 @@ int main(int argc, char *argv[]) {
                             //file is open and a file, we can close it
                             if( closeFile( &openFiles , startCluster , &cwd , tokens->items[1] ) == -1)
                                 printf("Error: cannot close file...\n");
+                            else if( !fs_file_closed( &fs ) )
+                                printf("Error: cannot sync image\n");
                         }
                     }
                 }
@@ -176,7 +315,9 @@ int main(int argc, char *argv[]) {
                 }
                 else {
 
-                    if( checkIsFile( tokens->items[1] , &fs ) == -1 ) {
+                    DirEntryRef ref;
+
+                    if( !fs_resolve( &fs , tokens->items[1] , &ref ) || ( ref.attr & 0x10 ) ) {
                         printf("Error: file does not exist.");
                     }
                     else {
@@ -197,12 +338,12 @@ int main(int argc, char *argv[]) {
 
                                 //file is now understood to be open and in cwd, offset is also valid assumed
                                 //now check if offset larger than file
-                                if( newOffset > getFileSize( tokens->items[1] , &fs ) ) {
-                                    printf("Error: offset %s larger than file size %u\n" , tokens->items[1] , getFileSize( tokens->items[2] , &fs ) );
+                                if( newOffset > ref.size ) {
+                                    printf("Error: offset %s larger than file size %u\n" , tokens->items[2] , ref.size );
                                 }
                                 else {
                                     //we can now write offset to oopen file
-                                    if( writeFileOffset( &openFiles , getStartCluster( tokens->items[1] , &fs ) , tokens->items[1] , cwd.cwd , newOffset ) == -1 ) {
+                                    if( writeFileOffset( &openFiles , ref.first_cluster , tokens->items[1] , cwd.cwd , newOffset ) == -1 ) {
                                         printf("Error: unable to write offset to file.\n");
                                     }
                                 }
@@ -227,7 +368,9 @@ int main(int argc, char *argv[]) {
                 }
                 else {
 
-                    if( checkIsFile( tokens->items[1] , &fs ) == -1 ) {
+                    DirEntryRef ref;
+
+                    if( !fs_resolve( &fs , tokens->items[1] , &ref ) || ( ref.attr & 0x10 ) ) {
                         printf("Error: file does not exist...\n");
                     }
                     else {
@@ -242,7 +385,7 @@ int main(int argc, char *argv[]) {
                             //now check open to read
 
                             OpenFile* file = getOpenFile( &openFiles , 
-                                getStartCluster( tokens->items[1] , &fs ) , &cwd , tokens->items[1] );
+                                ref.first_cluster , &cwd , tokens->items[1] );
 
                             if( file == NULL || ( file->permissions != 1 && file->permissions != 3 ) ) {
 
@@ -253,7 +396,7 @@ int main(int argc, char *argv[]) {
                                 printf("Error: file not opened in read mode.\n");
                             }
                             else {
-                                uint32_t bytesRead = readFile( file->offset , bytesToRead , tokens->items[1] , &fs );
+                                uint32_t bytesRead = readFile( file->offset , bytesToRead , &ref , &fs , file );
 
                                 file->offset += bytesRead;
                             }
@@ -262,6 +405,60 @@ int main(int argc, char *argv[]) {
                 }
                 
             }
+            else if ( strcmp( cmd , "export" ) == 0 ) {
+
+                //like read, but the bytes go to a host file ("-" for stdout) without passing through the shell
+                if( tokens->size != 4 ) {
+                    printf("Error: Usage - export [FILENAME] [SIZE] [HOSTPATH]\n");
+                    goto skip;
+                }
+
+                char* endptr = NULL;
+
+                uint32_t bytesToExport = strtoull( tokens->items[2] , &endptr , 10);
+
+                DirEntryRef ref;
+
+                if( strcmp( endptr , "\0") != 0 ) {
+                    printf("Error: Usage - export [FILENAME] [SIZE] [HOSTPATH]\n");
+                }
+                else if( !fs_resolve( &fs , tokens->items[1] , &ref ) || ( ref.attr & 0x10 ) ) {
+                    printf("Error: file does not exist...\n");
+                }
+                else if( checkIsOpen( &openFiles , cwd.cwd , tokens->items[1] ) == 0 ) {
+                    printf("Error: file is not open...\n");
+                }
+                else {
+
+                    OpenFile* file = getOpenFile( &openFiles ,
+                        ref.first_cluster , &cwd , tokens->items[1] );
+
+                    if( file == NULL || ( file->permissions != 1 && file->permissions != 3 ) ) {
+                        printf("Error: file not opened in read mode.\n");
+                    }
+                    else {
+
+                        bool toStdout = ( strcmp( tokens->items[3] , "-" ) == 0 );
+                        FILE* host = toStdout ? stdout : fopen( tokens->items[3] , "wb" );
+
+                        if( host == NULL ) {
+                            printf("Error: cannot open host file %s\n", tokens->items[3]);
+                        }
+                        else {
+
+                            //anything stdio still holds has to come out before the kernel writes behind it
+                            fflush( host );
+
+                            uint32_t bytesExported = exportFile( file->offset , bytesToExport , &ref , fileno( host ) , &fs , file );
+
+                            file->offset += bytesExported;
+
+                            if( !toStdout )
+                                fclose( host );
+                        }
+                    }
+                }
+            }
             else if (strcmp(cmd, "rm") == 0) {
 
                 if (tokens->size != 2) {
@@ -290,7 +487,9 @@ int main(int argc, char *argv[]) {
                 }
                 else {
 
-                    if( checkIsFile( tokens->items[1] , &fs ) == -1 ) {
+                    DirEntryRef ref;
+
+                    if( !fs_resolve( &fs , tokens->items[1] , &ref ) || ( ref.attr & 0x10 ) ) {
                         printf("Error: file not found...\n");
                     }
                     else {
@@ -300,7 +499,7 @@ int main(int argc, char *argv[]) {
                         }
                         else {
                             
-                            OpenFile* file = getOpenFile( &openFiles , getStartCluster( tokens->items[1] , &fs ) , &cwd , tokens->items[1] );
+                            OpenFile* file = getOpenFile( &openFiles , ref.first_cluster , &cwd , tokens->items[1] );
 
                             if( file == NULL ) {
                                 printf("Error: cannot get open file.\n");
@@ -312,7 +511,7 @@ int main(int argc, char *argv[]) {
                                 }
                                 else {
                                     //file now assumed to be open and valid
-                                    uint32_t bytesWritten = writeToFile( tokens->items[1] , tokens->items[2] , file->offset ,  &fs , file ); 
+                                    uint32_t bytesWritten = writeToFile( &ref , tokens->items[2] , file->offset ,  &fs , file ); 
 
                                     if ( bytesWritten == 0 ) {
                                         printf("No Bytes Written...\n");
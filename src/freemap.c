@@ -0,0 +1,182 @@
+#include "freemap.h"
+#include <stdlib.h>
+#include <string.h>
+
+bool free_map_init(FreeMap *map, uint32_t total_clusters) {
+
+    memset(map, 0, sizeof(*map));
+
+    map->num_bits = total_clusters + 2;
+
+    size_t words = ((size_t)map->num_bits + 63) / 64;
+
+    map->bits = (uint64_t *) calloc(words, sizeof(uint64_t));
+
+    if (!map->bits)
+        return false;
+
+    //reserved entries 0 and 1 never get handed out
+    map->bits[0] |= 0x3;
+
+    //bits past the last cluster in the final word count as used too
+    uint32_t tail = map->num_bits % 64;
+    if (tail != 0)
+        map->bits[words - 1] |= ~((1ULL << tail) - 1);
+
+    map->free_count = total_clusters;
+    map->next_free = 2;
+
+    return true;
+}
+
+void free_map_init_counts(FreeMap *map, uint32_t total_clusters, uint32_t free_count, uint32_t next_free) {
+
+    memset(map, 0, sizeof(*map));
+
+    map->num_bits = total_clusters + 2;
+    map->free_count = free_count;
+    map->next_free = (next_free >= 2 && next_free < map->num_bits) ? next_free : 2;
+}
+
+void free_map_free(FreeMap *map) {
+
+    free(map->bits);
+    map->bits = NULL;
+    map->num_bits = 0;
+    map->free_count = 0;
+}
+
+void free_map_recount(FreeMap *map) {
+
+    if (!map->bits)
+        return;
+
+    size_t words = ((size_t)map->num_bits + 63) / 64;
+    uint64_t used = 0;
+
+    //reserved clusters and the padding past the last cluster are all set bits
+    for (size_t w = 0; w < words; w++)
+        used += (uint64_t)__builtin_popcountll(map->bits[w]);
+
+    map->free_count = (uint32_t)(words * 64 - used);
+}
+
+bool free_map_is_free(const FreeMap *map, uint32_t cluster) {
+
+    if (cluster >= map->num_bits || !map->bits)
+        return false;
+
+    return !(map->bits[cluster / 64] & (1ULL << (cluster % 64)));
+}
+
+void free_map_set_used(FreeMap *map, uint32_t cluster) {
+
+    if (!map->bits) {
+        if (map->free_count > 0)
+            map->free_count--;
+        return;
+    }
+
+    if (!free_map_is_free(map, cluster))
+        return;
+
+    map->bits[cluster / 64] |= (1ULL << (cluster % 64));
+    map->free_count--;
+}
+
+void free_map_set_free(FreeMap *map, uint32_t cluster) {
+
+    if (cluster < 2 || cluster >= map->num_bits)
+        return;
+
+    if (!map->bits) {
+        map->free_count++;
+        return;
+    }
+
+    if (free_map_is_free(map, cluster))
+        return;
+
+    map->bits[cluster / 64] &= ~(1ULL << (cluster % 64));
+    map->free_count++;
+}
+
+void free_map_set_free_range(FreeMap *map, uint32_t start, uint32_t count) {
+
+    if (start < 2)
+        return;
+
+    uint64_t end = (uint64_t)start + count;
+
+    if (end > map->num_bits)
+        end = map->num_bits;
+
+    if (!map->bits) {
+        if (end > start)
+            map->free_count += (uint32_t)(end - start);
+        return;
+    }
+
+    uint64_t c = start;
+
+    while (c < end) {
+
+        uint32_t bit = (uint32_t)(c % 64);
+        uint64_t n = 64 - bit;
+
+        if (n > end - c)
+            n = end - c;
+
+        uint64_t mask = (n == 64) ? ~0ULL : (((1ULL << n) - 1) << bit);
+        uint64_t *word = &map->bits[c / 64];
+
+        //only bits that were actually in use add to the free count
+        map->free_count += (uint32_t)__builtin_popcountll(*word & mask);
+        *word &= ~mask;
+
+        c += n;
+    }
+}
+
+/*
+ * scan_words()
+ * Looks for a clear bit in words [first, last). Full words are skipped with a
+ * single compare, so a mostly used region costs one test per 64 clusters.
+ */
+static uint32_t scan_words(const FreeMap *map, size_t first, size_t last) {
+
+    for (size_t w = first; w < last; w++) {
+
+        uint64_t word = map->bits[w];
+
+        if (word != ~0ULL)
+            return (uint32_t)(w * 64 + __builtin_ctzll(~word));
+    }
+
+    return 0;
+}
+
+uint32_t free_map_find(const FreeMap *map, uint32_t start) {
+
+    if (map->free_count == 0 || !map->bits)
+        return 0;
+
+    if (start < 2 || start >= map->num_bits)
+        start = 2;
+
+    size_t words = ((size_t)map->num_bits + 63) / 64;
+    size_t w = start / 64;
+
+    //finish the word the cursor sits in, ignoring bits below it
+    uint64_t word = map->bits[w] | ((1ULL << (start % 64)) - 1);
+
+    if (word != ~0ULL)
+        return (uint32_t)(w * 64 + __builtin_ctzll(~word));
+
+    uint32_t found = scan_words(map, w + 1, words);
+
+    if (found == 0)
+        found = scan_words(map, 0, w + 1); //wrap, word 0 is never all free so 0 stays "none"
+
+    return found;
+}
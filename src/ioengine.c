@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+#include "ioengine.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+
+    return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/* finish (the rest of) a request with plain positional I/O. On an O_DIRECT
+ * descriptor every call has to start on an aligned offset, so a short
+ * transfer only counts in whole blocks and the rest is done again */
+static bool run_sync(const IoEngine *engine, IoRequest *req, uint32_t done) {
+
+    uint32_t align = engine->align;
+
+    if (align > 1)
+        done -= done % align;
+
+    unsigned char *p = (unsigned char *) req->buf + done;
+    uint64_t offset = req->offset + done;
+    size_t len = req->len - done;
+
+    while (len > 0) {
+
+        ssize_t n = req->write ? pwrite(engine->fd, p, len, (off_t)offset) : pread(engine->fd, p, len, (off_t)offset);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n > 0 && align > 1)
+            n -= n % align;
+
+        if (n <= 0)
+            return false;
+
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+
+    return true;
+}
+
+bool io_engine_init(IoEngine *engine, int fd, unsigned depth, uint32_t align) {
+
+    memset(engine, 0, sizeof(*engine));
+    engine->ring_fd = -1;
+    engine->fd = fd;
+    engine->align = align;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int ring_fd = uring_setup(depth, &p);
+
+    if (ring_fd < 0)
+        return false;
+
+    engine->ring_fd = ring_fd;
+    engine->depth = p.sq_entries;
+    engine->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    engine->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+
+    if (single) {
+        if (engine->cq_ring_size > engine->sq_ring_size)
+            engine->sq_ring_size = engine->cq_ring_size;
+        engine->cq_ring_size = engine->sq_ring_size;
+    }
+
+    engine->sq_ring = mmap(NULL, engine->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, IORING_OFF_SQ_RING);
+
+    if (engine->sq_ring == MAP_FAILED) {
+        engine->sq_ring = NULL;
+        io_engine_free(engine);
+        return false;
+    }
+
+    if (single) {
+        engine->cq_ring = engine->sq_ring;
+    }
+    else {
+        engine->cq_ring = mmap(NULL, engine->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, IORING_OFF_CQ_RING);
+
+        if (engine->cq_ring == MAP_FAILED) {
+            engine->cq_ring = NULL;
+            io_engine_free(engine);
+            return false;
+        }
+    }
+
+    engine->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    engine->sqes = mmap(NULL, engine->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, IORING_OFF_SQES);
+
+    if (engine->sqes == MAP_FAILED) {
+        engine->sqes = NULL;
+        io_engine_free(engine);
+        return false;
+    }
+
+    unsigned char *sq = (unsigned char *) engine->sq_ring;
+    unsigned char *cq = (unsigned char *) engine->cq_ring;
+
+    engine->sq_head = (unsigned *)(sq + p.sq_off.head);
+    engine->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    engine->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    engine->sq_array = (unsigned *)(sq + p.sq_off.array);
+    engine->cq_head = (unsigned *)(cq + p.cq_off.head);
+    engine->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    engine->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    engine->cqes = cq + p.cq_off.cqes;
+
+    return true;
+}
+
+void io_engine_free(IoEngine *engine) {
+
+    if (engine->sqes)
+        munmap(engine->sqes, engine->sqes_size);
+    if (engine->cq_ring && engine->cq_ring != engine->sq_ring)
+        munmap(engine->cq_ring, engine->cq_ring_size);
+    if (engine->sq_ring)
+        munmap(engine->sq_ring, engine->sq_ring_size);
+    if (engine->ring_fd >= 0)
+        close(engine->ring_fd);
+
+    memset(engine, 0, sizeof(*engine));
+    engine->ring_fd = -1;
+}
+
+/* put request 'index' on the submission ring, the caller submits it */
+static void queue_request(IoEngine *engine, IoRequest *req, uint32_t index) {
+
+    unsigned tail = *engine->sq_tail;
+    unsigned slot = tail & *engine->sq_mask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *) engine->sqes)[slot];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = engine->fd;
+    sqe->off = req->offset;
+    sqe->addr = (uint64_t)(uintptr_t) req->buf;
+    sqe->len = req->len;
+    sqe->user_data = index;
+
+    engine->sq_array[slot] = slot;
+
+    //the kernel must see the entry before it sees the new tail
+    __atomic_store_n(engine->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+bool io_engine_run(IoEngine *engine, IoRequest *reqs, uint32_t count) {
+
+    uint32_t next = 0; // next request to queue
+    uint32_t inflight = 0;
+    unsigned pending = 0; // queued but not yet handed to io_uring_enter
+    bool ok = true;
+
+    while (next < count || inflight > 0) {
+
+        while (next < count && inflight < engine->depth) {
+            queue_request(engine, &reqs[next], next);
+            next++;
+            inflight++;
+            pending++;
+        }
+
+        int r = uring_enter(engine->ring_fd, pending, 1, IORING_ENTER_GETEVENTS);
+
+        if (r >= 0) {
+            pending -= ((unsigned) r < pending) ? (unsigned) r : pending;
+        }
+        else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+
+            /* The ring itself failed. Reads and writes in a batch never
+             * overlap, so doing every request again by hand is safe */
+            for (uint32_t i = 0; i < count; i++)
+                ok = run_sync(engine, &reqs[i], 0) && ok;
+
+            return ok;
+        }
+
+        unsigned head = *engine->cq_head;
+        unsigned tail = __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+
+            struct io_uring_cqe *cqe = &((struct io_uring_cqe *) engine->cqes)[head & *engine->cq_mask];
+            IoRequest *req = &reqs[cqe->user_data];
+            uint32_t done = (cqe->res > 0) ? (uint32_t) cqe->res : 0;
+
+            if (cqe->res < 0 || done < req->len) {
+                if (!run_sync(engine, req, done))
+                    ok = false;
+            }
+
+            inflight--;
+            head++;
+        }
+
+        __atomic_store_n(engine->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return ok;
+}
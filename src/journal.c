@@ -0,0 +1,325 @@
+#define _POSIX_C_SOURCE 200809L
+#include "journal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static uint64_t fnv1a(uint64_t hash, const unsigned char *p, size_t len) {
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+static uint64_t record_checksum(unsigned char *record, uint64_t bytes) {
+
+    JournalHeader *h = (JournalHeader *) record;
+    uint64_t saved = h->checksum;
+
+    h->checksum = 0;
+    uint64_t sum = fnv1a(0xCBF29CE484222325ULL, record, (size_t)bytes);
+    h->checksum = saved;
+
+    return sum;
+}
+
+static bool log_pwrite(int fd, const unsigned char *p, size_t len, uint64_t offset) {
+
+    while (len > 0) {
+
+        ssize_t n = pwrite(fd, p, len, (off_t)offset);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+
+    return true;
+}
+
+static bool log_pread(int fd, unsigned char *p, size_t len, uint64_t offset) {
+
+    while (len > 0) {
+
+        ssize_t n = pread(fd, p, len, (off_t)offset);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+
+    return true;
+}
+
+void journal_txn_init(JournalTxn *txn) {
+
+    memset(txn, 0, sizeof(*txn));
+}
+
+void journal_txn_free(JournalTxn *txn) {
+
+    free(txn->blocks);
+    memset(txn, 0, sizeof(*txn));
+}
+
+bool journal_txn_add(JournalTxn *txn, uint64_t offset, void *buf, uint32_t len) {
+
+    if (txn->count == txn->capacity) {
+
+        uint32_t capacity = (txn->capacity == 0) ? 16 : txn->capacity * 2;
+        IoRequest *blocks = (IoRequest *) realloc(txn->blocks, capacity * sizeof(IoRequest));
+
+        if (!blocks)
+            return false;
+
+        txn->blocks = blocks;
+        txn->capacity = capacity;
+    }
+
+    IoRequest *b = &txn->blocks[txn->count++];
+
+    b->offset = offset;
+    b->buf = buf;
+    b->len = len;
+    b->write = true;
+
+    return true;
+}
+
+bool journal_open(Journal *journal, const char *path, BlockDevice *image) {
+
+    memset(journal, 0, sizeof(*journal));
+
+    journal->image = image;
+
+    journal->fd = open(path, O_RDWR | O_CREAT, 0644);
+
+    if (journal->fd < 0)
+        return false;
+
+    //whatever is in there was replayed at mount or is a torn tail, start empty
+    if (ftruncate(journal->fd, 0) != 0) {
+        close(journal->fd);
+        journal->fd = -1;
+        return false;
+    }
+
+    journal->seq = 1;
+
+    return true;
+}
+
+void journal_close(Journal *journal) {
+
+    if (journal->fd >= 0)
+        close(journal->fd);
+
+    journal->fd = -1;
+}
+
+bool journal_active(const Journal *journal) {
+
+    return journal->fd >= 0;
+}
+
+int journal_replay(const char *path, BlockDevice *dev) {
+
+    int fd = open(path, O_RDWR);
+
+    if (fd < 0)
+        return (errno == ENOENT) ? 0 : -1;
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    uint64_t size = (uint64_t)st.st_size;
+    uint64_t pos = 0;
+    uint64_t seq = 0;
+    int replayed = 0;
+
+    while (size - pos >= sizeof(JournalHeader)) {
+
+        JournalHeader h;
+
+        if (!log_pread(fd, (unsigned char *) &h, sizeof(h), pos))
+            break;
+
+        uint64_t min_bytes = sizeof(JournalHeader) + (uint64_t)h.count * sizeof(JournalBlock);
+
+        //torn or stale tail, the log ends here
+        if (h.magic != JOURNAL_MAGIC || h.bytes < min_bytes || h.bytes > size - pos ||
+            (replayed > 0 && h.seq != seq + 1))
+            break;
+
+        unsigned char *record = (unsigned char *) malloc((size_t)h.bytes);
+
+        if (!record) {
+            close(fd);
+            return -1;
+        }
+
+        if (!log_pread(fd, record, (size_t)h.bytes, pos) || record_checksum(record, h.bytes) != h.checksum) {
+            free(record);
+            break;
+        }
+
+        const JournalBlock *blocks = (const JournalBlock *) (record + sizeof(JournalHeader));
+        uint64_t data = min_bytes;
+        bool ok = true;
+
+        for (uint32_t i = 0; i < h.count && ok; i++) {
+            ok = data + blocks[i].len <= h.bytes &&
+                 blockdev_write(dev, blocks[i].offset, record + data, blocks[i].len);
+            data += blocks[i].len;
+        }
+
+        free(record);
+
+        if (!ok) {
+            close(fd);
+            return -1;
+        }
+
+        seq = h.seq;
+        pos += h.bytes;
+        replayed++;
+    }
+
+    //the image has to hold the blocks for good before the log lets go of them
+    if (replayed > 0 && !blockdev_sync(dev)) {
+        close(fd);
+        return -1;
+    }
+
+    bool ok = ftruncate(fd, 0) == 0 && fsync(fd) == 0;
+
+    close(fd);
+
+    return ok ? replayed : -1;
+}
+
+bool journal_append(Journal *journal, const JournalTxn *txn) {
+
+    if (!journal_active(journal) || txn->count == 0)
+        return true;
+
+    uint64_t bytes = sizeof(JournalHeader) + (uint64_t)txn->count * sizeof(JournalBlock);
+
+    for (uint32_t i = 0; i < txn->count; i++)
+        bytes += txn->blocks[i].len;
+
+    unsigned char *record = (unsigned char *) calloc(1, (size_t)bytes);
+
+    if (!record)
+        return false;
+
+    JournalHeader *h = (JournalHeader *) record;
+    JournalBlock *blocks = (JournalBlock *) (record + sizeof(JournalHeader));
+    unsigned char *data = (unsigned char *) (blocks + txn->count);
+
+    h->magic = JOURNAL_MAGIC;
+    h->count = txn->count;
+    h->seq = journal->seq;
+    h->bytes = bytes;
+
+    for (uint32_t i = 0; i < txn->count; i++) {
+        blocks[i].offset = txn->blocks[i].offset;
+        blocks[i].len = txn->blocks[i].len;
+        memcpy(data, txn->blocks[i].buf, txn->blocks[i].len);
+        data += txn->blocks[i].len;
+    }
+
+    h->checksum = record_checksum(record, bytes);
+
+    //one write for the whole record, a crash can only cut it short
+    bool ok = log_pwrite(journal->fd, record, (size_t)bytes, journal->size);
+
+    free(record);
+
+    if (!ok)
+        return false;
+
+    journal->size += bytes;
+    journal->seq++;
+    journal->unsynced++;
+
+    if (journal->unsynced >= JOURNAL_GROUP_RECORDS)
+        return journal_commit(journal);
+
+    return true;
+}
+
+bool journal_commit(Journal *journal) {
+
+    if (!journal_active(journal) || journal->unsynced == 0)
+        return true;
+
+    //records can point at data written in place, it has to be on disk first
+    if (!journal_sync_data(journal))
+        return false;
+
+    if (fdatasync(journal->fd) != 0)
+        return false;
+
+    journal->unsynced = 0;
+
+    return true;
+}
+
+void journal_data_written(Journal *journal) {
+
+    if (journal_active(journal))
+        journal->data_unsynced = true;
+}
+
+bool journal_sync_data(Journal *journal) {
+
+    if (!journal_active(journal) || !journal->data_unsynced)
+        return true;
+
+    if (!blockdev_sync(journal->image))
+        return false;
+
+    journal->data_unsynced = false;
+
+    return true;
+}
+
+bool journal_full(const Journal *journal) {
+
+    return journal->size >= JOURNAL_CHECKPOINT_BYTES;
+}
+
+bool journal_reset(Journal *journal) {
+
+    if (!journal_active(journal))
+        return true;
+
+    if (ftruncate(journal->fd, 0) != 0 || fdatasync(journal->fd) != 0)
+        return false;
+
+    journal->size = 0;
+    journal->unsynced = 0;
+
+    return true;
+}
@@ -27,6 +27,10 @@ struct OpenFiles getOpenFilesStruct() { //returnns intialized openfiles object
         files.files[i].open = 0;
         files.files[i].startCluster = 0;
         files.files[i].permissions = -1;
+        extent_map_init( &files.files[i].extents );
+        files.files[i].raNext = 0;
+        files.files[i].raWindow = 0;
+        files.files[i].raEnd = 0;
 
     }
 
@@ -62,6 +66,10 @@ int openFile( struct OpenFiles* files ,  char* fileName , int mode , uint32_t st
     files->files[index].offset = 0;
     files->files[index].open = 1;
     files->files[index].startCluster = startCluster;
+    extent_map_clear( &files->files[index].extents );
+    files->files[index].raNext = 0;
+    files->files[index].raWindow = 0;
+    files->files[index].raEnd = 0;
 
     char* path = (char*) malloc( sizeof(char) * direc->size + 1 );
 
@@ -99,6 +107,7 @@ int closeFile( struct OpenFiles* files , uint32_t startCluster , CurrentDirector
     }
 
     free( files->files[index].filePath );
+    extent_map_free( &files->files[index].extents );
 
     files->files[index].open = 0; //set open flag to false so can be overwritten
 
@@ -112,6 +121,8 @@ void closeAllFiles( struct OpenFiles* files ) {
         if( files->files[i].open == 1 ) {
             free( files->files[i].filePath );
         }
+
+        extent_map_free( &files->files[i].extents );
     }
 
 }